@@ -0,0 +1,1327 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TPOOL_IMPLEMENTATION
+#include "tpool.h"
+
+/*
+	Deque benchmark
+
+	Every thread owns one queue. Thread 0 gets the root of a binary tree of tasks, executing a task pushes its two
+	children onto the executor's own queue, and idle threads steal round-robin. This is the shape of the pool's
+	fan-out workloads with the task bodies taken out, so what's left is queue overhead.
+
+	The mutex ring is the queue the pool used before the Chase-Lev deque: push at head and pop at tail under a
+	per-queue lock, thieves give up when trylock fails.
+*/
+
+typedef struct MutexRing {
+	TPoolTask *queue;
+	size_t capacity;
+	_Atomic uint64_t head;
+	_Atomic uint64_t tail;
+	pthread_mutex_t queue_lock;
+} MutexRing;
+
+static void *mring_create(void) {
+	MutexRing *ring = calloc(sizeof(MutexRing), 1);
+	mutex_init(&ring->queue_lock);
+	ring->capacity = THREAD_QUEUE_CAP;
+	ring->queue = malloc(sizeof(TPoolTask) * ring->capacity);
+	return ring;
+}
+static void mring_destroy(void *q) {
+	MutexRing *ring = (MutexRing *)q;
+	free(ring->queue);
+	free(ring);
+}
+static bool mring_push(void *q, TPoolTask task) {
+	MutexRing *ring = (MutexRing *)q;
+	mutex_lock(&ring->queue_lock);
+	if ((ring->head - ring->tail) >= ring->capacity) {
+		mutex_unlock(&ring->queue_lock);
+		return false;
+	}
+	ring->queue[ring->head % ring->capacity] = task;
+	ring->head++;
+	mutex_unlock(&ring->queue_lock);
+	return true;
+}
+static bool mring_take(MutexRing *ring, TPoolTask *task) {
+	if (ring->tail >= ring->head) {
+		return false;
+	}
+	*task = ring->queue[ring->tail % ring->capacity];
+	ring->tail++;
+	return true;
+}
+static bool mring_pop(void *q, TPoolTask *task) {
+	MutexRing *ring = (MutexRing *)q;
+	if (ring->head <= ring->tail) {
+		return false;
+	}
+	mutex_lock(&ring->queue_lock);
+	bool ret = mring_take(ring, task);
+	mutex_unlock(&ring->queue_lock);
+	return ret;
+}
+static bool mring_steal(void *q, TPoolTask *task) {
+	MutexRing *ring = (MutexRing *)q;
+	if (ring->head <= ring->tail) {
+		return false;
+	}
+	if (mutex_trylock(&ring->queue_lock)) {
+		return false;
+	}
+	bool ret = mring_take(ring, task);
+	mutex_unlock(&ring->queue_lock);
+	return ret;
+}
+
+static void *deque_create(void) {
+	TQueue *queue = calloc(sizeof(TQueue), 1);
+	tqueue_init(queue, THREAD_QUEUE_CAP, THREAD_QUEUE_CAP);
+	return queue;
+}
+static void deque_destroy(void *q) {
+	tqueue_free((TQueue *)q);
+	free(q);
+}
+static bool deque_push(void *q, TPoolTask task)   { return tqueue_push((TQueue *)q, task); }
+static bool deque_pop(void *q, TPoolTask *task)   { return tqueue_pop((TQueue *)q, task); }
+static bool deque_steal(void *q, TPoolTask *task) { return tqueue_steal((TQueue *)q, task); }
+
+typedef struct BenchQueueOps {
+	const char *name;
+	void *(*create)(void);
+	void (*destroy)(void *q);
+	bool (*push)(void *q, TPoolTask task);
+	bool (*pop)(void *q, TPoolTask *task);
+	bool (*steal)(void *q, TPoolTask *task);
+} BenchQueueOps;
+
+static BenchQueueOps bench_queues[] = {
+	{ "mutex_ring",  mring_create, mring_destroy, mring_push, mring_pop, mring_steal },
+	{ "chase_lev",   deque_create, deque_destroy, deque_push, deque_pop, deque_steal },
+};
+
+typedef struct DequeBench {
+	BenchQueueOps *ops;
+	void **queues;
+	int thread_count;
+	uint64_t task_count;
+	_Atomic uint64_t tasks_done;
+} DequeBench;
+
+typedef struct DequeBenchThread {
+	DequeBench *bench;
+	int idx;
+	pthread_t thread;
+} DequeBenchThread;
+
+// Returns how many tasks were executed, children that don't fit in the queue get run inline
+static uint64_t deque_bench_run_task(DequeBench *bench, void *queue, TPoolTask task) {
+	uintptr_t depth = (uintptr_t)task.args;
+	if (depth == 0) {
+		return 1;
+	}
+
+	uint64_t done = 1;
+	TPoolTask child = { .do_work = NULL, .args = (void *)(depth - 1) };
+	for (int i = 0; i < 2; i++) {
+		if (!bench->ops->push(queue, child)) {
+			done += deque_bench_run_task(bench, queue, child);
+		}
+	}
+	return done;
+}
+
+static void *deque_bench_worker(void *ptr) {
+	DequeBenchThread *self = (DequeBenchThread *)ptr;
+	DequeBench *bench = self->bench;
+	void *queue = bench->queues[self->idx];
+
+	// completions are published in batches so the shared counter doesn't swamp the numbers
+	uint64_t local_done = 0;
+	while (bench->tasks_done < bench->task_count) {
+		TPoolTask task;
+		while (bench->ops->pop(queue, &task)) {
+			local_done += deque_bench_run_task(bench, queue, task);
+			if (local_done >= 256) {
+				bench->tasks_done += local_done;
+				local_done = 0;
+			}
+		}
+
+		bench->tasks_done += local_done;
+		local_done = 0;
+
+		bool stole = false;
+		int idx = self->idx;
+		for (int i = 1; i < bench->thread_count; i++) {
+			idx = (idx + 1) % bench->thread_count;
+			if (bench->ops->steal(bench->queues[idx], &task)) {
+				local_done += deque_bench_run_task(bench, queue, task);
+				stole = true;
+				break;
+			}
+		}
+		if (!stole) {
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+static double deque_bench(BenchQueueOps *ops, int thread_count, int depth) {
+	DequeBench bench = {0};
+	bench.ops = ops;
+	bench.thread_count = thread_count;
+	bench.task_count = (2ull << depth) - 1;
+	bench.queues = calloc(sizeof(void *), thread_count);
+	for (int i = 0; i < thread_count; i++) {
+		bench.queues[i] = ops->create();
+	}
+
+	TPoolTask root = { .do_work = NULL, .args = (void *)(uintptr_t)depth };
+	ops->push(bench.queues[0], root);
+
+	DequeBenchThread *threads = calloc(sizeof(DequeBenchThread), thread_count);
+	uint64_t start = tpool_now_ns();
+	for (int i = 1; i < thread_count; i++) {
+		threads[i].bench = &bench;
+		threads[i].idx = i;
+		pthread_create(&threads[i].thread, NULL, deque_bench_worker, &threads[i]);
+	}
+	threads[0].bench = &bench;
+	threads[0].idx = 0;
+	deque_bench_worker(&threads[0]);
+	for (int i = 1; i < thread_count; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+	uint64_t elapsed = tpool_now_ns() - start;
+
+	for (int i = 0; i < thread_count; i++) {
+		ops->destroy(bench.queues[i]);
+	}
+	free(bench.queues);
+	free(threads);
+
+	return (double)bench.task_count / ((double)elapsed / 1000000000.0);
+}
+
+static void deque_bench_main(int argc, char **argv) {
+	int depth = 20;
+	int max_threads = 64;
+	if (argc > 0) depth = atoi(argv[0]);
+	if (argc > 1) max_threads = atoi(argv[1]);
+
+	printf("deque: binary tree of %" PRIu64 " tasks\n", (uint64_t)(2ull << depth) - 1);
+	printf("%-8s", "threads");
+	for (size_t q = 0; q < sizeof(bench_queues) / sizeof(bench_queues[0]); q++) {
+		printf(" %16s", bench_queues[q].name);
+	}
+	printf("   (tasks/sec)\n");
+
+	for (int thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+		printf("%-8d", thread_count);
+		for (size_t q = 0; q < sizeof(bench_queues) / sizeof(bench_queues[0]); q++) {
+			printf(" %16.0f", deque_bench(&bench_queues[q], thread_count, depth));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+}
+
+/*
+	Deque check
+
+	Not a benchmark: the owner pushes ids 0..N-1 into a queue that starts small enough to grow several times, and
+	pops some of them back in between, while thieves take single tasks and batches off the other end. Every id has
+	to come out exactly once, or the run fails.
+*/
+
+typedef struct DequeCheck {
+	TQueue queue;
+	uint64_t count;
+	_Atomic uint8_t *seen;
+	_Atomic uint64_t taken;
+	_Atomic bool pushing;
+} DequeCheck;
+
+typedef struct DequeCheckThief {
+	DequeCheck *check;
+	bool batch;
+	pthread_t thread;
+} DequeCheckThief;
+
+static void deque_check_take(DequeCheck *check, const TPoolTask *task) {
+	atomic_fetch_add_explicit(&check->seen[(uintptr_t)task->args], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&check->taken, 1, memory_order_relaxed);
+}
+
+static void *deque_check_thief(void *ptr) {
+	DequeCheckThief *self = (DequeCheckThief *)ptr;
+	DequeCheck *check = self->check;
+	TPoolTask tasks[TPOOL_STEAL_HALF_MAX];
+	while (atomic_load_explicit(&check->pushing, memory_order_acquire) || tqueue_size(&check->queue) > 0) {
+		size_t got = self->batch
+			? tqueue_steal_batch(&check->queue, tasks, TPOOL_STEAL_HALF_MAX)
+			: (size_t)tqueue_steal(&check->queue, tasks);
+		for (size_t i = 0; i < got; i++) {
+			deque_check_take(check, &tasks[i]);
+		}
+	}
+	return NULL;
+}
+
+// Returns how many ids didn't come out exactly once
+static uint64_t deque_check(int thief_count, uint64_t count) {
+	DequeCheck check = {0};
+	check.count = count;
+	check.seen = calloc(count, sizeof(*check.seen));
+	tqueue_init(&check.queue, 64, THREAD_QUEUE_MAX_CAP);
+	check.queue.steal_max = TPOOL_STEAL_HALF_MAX;
+	atomic_store_explicit(&check.pushing, true, memory_order_relaxed);
+
+	DequeCheckThief *thieves = calloc(sizeof(DequeCheckThief), thief_count);
+	for (int i = 0; i < thief_count; i++) {
+		thieves[i].check = &check;
+		thieves[i].batch = i & 1;
+		pthread_create(&thieves[i].thread, NULL, deque_check_thief, &thieves[i]);
+	}
+
+	// Mostly the owner keeps the queue down to a few tasks, where its pops race thieves for tail. Every so often it
+	// lets the queue fill up for a while so the buffer grows under the thieves too.
+	uint64_t rng = 0x9E3779B97F4A7C15ull;
+	for (uint64_t id = 0; id < count; id++) {
+		TPoolTask task = { .do_work = NULL, .args = (void *)(uintptr_t)id };
+		if (!tqueue_push(&check.queue, task)) {
+			deque_check_take(&check, &task);
+		}
+		rng ^= rng << 13;
+		rng ^= rng >> 7;
+		rng ^= rng << 17;
+		if ((id & 0xFFFF) < 0xF000) {
+			int64_t keep = (int64_t)((rng >> 8) & 7);
+			while (tqueue_size(&check.queue) > keep && tqueue_pop(&check.queue, &task)) {
+				deque_check_take(&check, &task);
+			}
+		}
+	}
+	TPoolTask task;
+	while (tqueue_pop(&check.queue, &task)) {
+		deque_check_take(&check, &task);
+	}
+	atomic_store_explicit(&check.pushing, false, memory_order_release);
+	for (int i = 0; i < thief_count; i++) {
+		pthread_join(thieves[i].thread, NULL);
+	}
+
+	uint64_t bad = 0;
+	for (uint64_t id = 0; id < count; id++) {
+		uint8_t seen = atomic_load_explicit(&check.seen[id], memory_order_relaxed);
+		if (seen != 1) {
+			if (bad < 10) {
+				printf("  id %" PRIu64 " came out %d times\n", id, seen);
+			}
+			bad++;
+		}
+	}
+
+	tqueue_free(&check.queue);
+	free(thieves);
+	free((void *)check.seen);
+	return bad;
+}
+
+/*
+	Injection queue check
+
+	Producers push their own ranges of ids into the MPMC injection ring, waiting whenever it's full, while consumers
+	pop batches of 1 up to TPOOL_INJECT_BATCH. Same rule as the deque: every id exactly once.
+*/
+
+typedef struct InjectCheck {
+	TPoolInject inject;
+	uint64_t count;
+	int producer_count;
+	_Atomic uint8_t *seen;
+	_Atomic uint64_t taken;
+} InjectCheck;
+
+typedef struct InjectCheckThread {
+	InjectCheck *check;
+	int idx;
+	pthread_t thread;
+} InjectCheckThread;
+
+static void *inject_check_producer(void *ptr) {
+	InjectCheckThread *self = (InjectCheckThread *)ptr;
+	InjectCheck *check = self->check;
+	for (uint64_t id = (uint64_t)self->idx; id < check->count; id += (uint64_t)check->producer_count) {
+		TPoolTask task = { .do_work = NULL, .args = (void *)(uintptr_t)id };
+		while (!tinject_push(&check->inject, &task)) {
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+static void *inject_check_consumer(void *ptr) {
+	InjectCheckThread *self = (InjectCheckThread *)ptr;
+	InjectCheck *check = self->check;
+	TPoolTask tasks[TPOOL_INJECT_BATCH];
+	size_t max = 1;
+	while (atomic_load_explicit(&check->taken, memory_order_relaxed) < check->count) {
+		size_t got = tinject_pop_batch(&check->inject, tasks, max);
+		for (size_t i = 0; i < got; i++) {
+			atomic_fetch_add_explicit(&check->seen[(uintptr_t)tasks[i].args], 1, memory_order_relaxed);
+		}
+		atomic_fetch_add_explicit(&check->taken, got, memory_order_relaxed);
+		max = max % TPOOL_INJECT_BATCH + 1;
+		if (!got) {
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+// Returns how many ids didn't come out exactly once
+static uint64_t inject_check(int producer_count, int consumer_count, uint64_t count) {
+	InjectCheck check = {0};
+	check.count = count;
+	check.producer_count = producer_count;
+	check.seen = calloc(count, sizeof(*check.seen));
+	tinject_init(&check.inject);
+
+	int thread_count = producer_count + consumer_count;
+	InjectCheckThread *threads = calloc(sizeof(InjectCheckThread), thread_count);
+	for (int i = 0; i < thread_count; i++) {
+		threads[i].check = &check;
+		threads[i].idx = i < producer_count ? i : i - producer_count;
+		pthread_create(&threads[i].thread, NULL, i < producer_count ? inject_check_producer : inject_check_consumer, &threads[i]);
+	}
+	for (int i = 0; i < thread_count; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+
+	uint64_t bad = 0;
+	for (uint64_t id = 0; id < count; id++) {
+		uint8_t seen = atomic_load_explicit(&check.seen[id], memory_order_relaxed);
+		if (seen != 1) {
+			if (bad < 10) {
+				printf("  id %" PRIu64 " came out %d times\n", id, seen);
+			}
+			bad++;
+		}
+	}
+
+	tpool__free_aligned(check.inject.cells);
+	free(threads);
+	free((void *)check.seen);
+	return bad;
+}
+
+static void check_main(int argc, char **argv) {
+	uint64_t count = 1 << 22;
+	int max_thieves = 8;
+	if (argc > 0) count = strtoull(argv[0], NULL, 10);
+	if (argc > 1) max_thieves = atoi(argv[1]);
+
+	uint64_t failures = 0;
+	for (int thieves = 1; thieves <= max_thieves; thieves *= 2) {
+		uint64_t bad = deque_check(thieves, count);
+		printf("check deque, %d thieves, %" PRIu64 " ids: %s\n", thieves, count, bad ? "FAILED" : "ok");
+		failures += bad;
+	}
+	for (int threads = 1; threads <= max_thieves; threads *= 2) {
+		uint64_t bad = inject_check(threads, threads, count);
+		printf("check inject, %d producers, %d consumers, %" PRIu64 " ids: %s\n", threads, threads, count, bad ? "FAILED" : "ok");
+		failures += bad;
+	}
+	if (failures) {
+		exit(1);
+	}
+}
+
+/*
+	Park benchmark
+
+	Bursts of short tasks separated by gaps long enough for every worker to go back to sleep. For each spin count,
+	reports how long a parked worker takes to start running after a push, and how much CPU the workers burned
+	spinning while they had nothing to do.
+*/
+
+static ssize_t park_bench_task(void *args) {
+	uint64_t end = tpool_now_ns() + (uint64_t)(uintptr_t)args;
+	while (tpool_now_ns() < end) {
+		tpool__pause();
+	}
+	return 0;
+}
+
+static void park_bench(int thread_count, int64_t spin_count, int rounds, int burst) {
+	TPool *pool = tpool_init(thread_count - 1);
+	atomic_store_explicit(&pool->spin_count, spin_count, memory_order_relaxed);
+
+	uint64_t busy_ns = 0;
+	for (int r = 0; r < rounds; r++) {
+		uint64_t start = tpool_now_ns();
+		for (int i = 0; i < burst; i++) {
+			TPoolTask task = { .do_work = park_bench_task, .args = (void *)(uintptr_t)2000 };
+			tpool_push(pool, task);
+		}
+		tpool_wait(pool);
+		busy_ns += tpool_now_ns() - start;
+
+		usleep(2000);
+	}
+
+	TPoolStats stats;
+	tpool_stats(pool, &stats);
+	tpool_destroy(pool);
+
+	printf("%-12" PRId64 " %12.1f %8" PRIu64 " %8" PRIu64 " %14.2f %14.2f %10.2f %10.2f\n",
+	       spin_count,
+	       (double)busy_ns / rounds / 1000.0,
+	       stats.parks,
+	       stats.wakes,
+	       stats.wakes ? (double)stats.wake_latency_ns / stats.wakes / 1000.0 : 0.0,
+	       (double)stats.wake_latency_max_ns / 1000.0,
+	       (double)stats.spin_ns / 1000000.0,
+	       (double)stats.park_ns / 1000000.0);
+}
+
+static void park_bench_main(int argc, char **argv) {
+	int thread_count = 8;
+	int rounds = 200;
+	if (argc > 0) thread_count = atoi(argv[0]);
+	if (argc > 1) rounds = atoi(argv[1]);
+
+	printf("park: %d threads, %d bursts of %d x 2us tasks with 2ms gaps\n", thread_count, rounds, thread_count * 4);
+	printf("%-12s %12s %8s %8s %14s %14s %10s %10s\n",
+	       "spin_count", "burst_us", "parks", "wakes", "wake_mean_us", "wake_max_us", "spin_ms", "park_ms");
+
+	int64_t spin_counts[] = { 0, 100, 1000, 10000, 100000 };
+	for (size_t i = 0; i < sizeof(spin_counts) / sizeof(spin_counts[0]); i++) {
+		park_bench(thread_count, spin_counts[i], rounds, thread_count * 4);
+		fflush(stdout);
+	}
+}
+
+/*
+	Submit benchmark
+
+	Submitting the same tasks one tpool_push at a time versus a single tpool_push_batch, for a few batch sizes.
+	Tasks are empty so the workers pulling them off don't dominate; submit_ns is just the time spent pushing.
+*/
+
+static ssize_t submit_bench_task(void *args) {
+	(void)args;
+	return 0;
+}
+
+static void submit_bench(int thread_count, size_t batch, uint64_t total) {
+	TPool *pool = tpool_init(thread_count - 1);
+	TPoolTask *tasks = calloc(sizeof(TPoolTask), batch);
+	for (size_t i = 0; i < batch; i++) {
+		tasks[i].do_work = submit_bench_task;
+	}
+
+	uint64_t rounds = (total + batch - 1) / batch;
+	uint64_t single_ns = 0, batch_ns = 0;
+	for (uint64_t r = 0; r < rounds; r++) {
+		uint64_t start = tpool_now_ns();
+		for (size_t i = 0; i < batch; i++) {
+			tpool_push(pool, tasks[i]);
+		}
+		single_ns += tpool_now_ns() - start;
+		tpool_wait(pool);
+
+		start = tpool_now_ns();
+		tpool_push_batch(pool, tasks, batch);
+		batch_ns += tpool_now_ns() - start;
+		tpool_wait(pool);
+	}
+
+	free(tasks);
+	tpool_destroy(pool);
+
+	double submitted = (double)(rounds * batch);
+	printf("%-10zu %18.0f %18.0f %10.2fx\n", batch,
+	       submitted / ((double)single_ns / 1000000000.0),
+	       submitted / ((double)batch_ns / 1000000000.0),
+	       (double)single_ns / (double)batch_ns);
+}
+
+static void submit_bench_main(int argc, char **argv) {
+	int thread_count = 8;
+	if (argc > 0) thread_count = atoi(argv[0]);
+
+	printf("submit: %d threads, empty tasks\n", thread_count);
+	printf("%-10s %18s %18s %11s\n", "batch", "push (tasks/sec)", "batch (tasks/sec)", "speedup");
+
+	size_t batches[] = { 10, 1000, 100000 };
+	for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+		submit_bench(thread_count, batches[i], 1000000);
+		fflush(stdout);
+	}
+}
+
+/*
+	Fan-out benchmark
+
+	A binary tree of tasks fanned out through groups on the real pool, each leaf touching a small array of its own.
+	Run with floating and pinned threads, stealing one task at a time or half a queue. Reports throughput, the
+	spread of per-tree times, and how much stealing it took.
+*/
+
+typedef struct FanoutNode {
+	int depth;
+	uint64_t *leaf_data;
+} FanoutNode;
+
+#define FANOUT_LEAF_WORDS 512
+
+static ssize_t fanout_task(void *args) {
+	FanoutNode *node = args;
+	if (node->depth == 0) {
+		uint64_t sum = 0;
+		for (int i = 0; i < FANOUT_LEAF_WORDS; i++) {
+			node->leaf_data[i] = node->leaf_data[i] * 3 + (uint64_t)i;
+			sum += node->leaf_data[i];
+		}
+		return (ssize_t)(sum & 1);
+	}
+
+	TPool *pool = current_thread->pool;
+	TPoolGroup group;
+	tpool_group_init(&group);
+	FanoutNode children[2];
+	for (int i = 0; i < 2; i++) {
+		children[i].depth = node->depth - 1;
+		children[i].leaf_data = node->leaf_data + (size_t)i * ((size_t)FANOUT_LEAF_WORDS << (node->depth - 1));
+		TPoolTask task = { .do_work = fanout_task, .args = &children[i] };
+		tpool_group_push(pool, &group, task);
+	}
+	tpool_group_wait(pool, &group);
+	return 0;
+}
+
+static int bench_cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void fanout_bench(int thread_count, bool pin, bool steal_half, int depth, int rounds) {
+	TPoolOptions opts = {0};
+	opts.child_thread_count = thread_count - 1;
+	opts.pin_threads = pin;
+	opts.steal_half = steal_half;
+	TPool *pool = tpool_init_opts(&opts);
+
+	uint64_t *data = calloc(sizeof(uint64_t), (size_t)FANOUT_LEAF_WORDS << depth);
+	uint64_t *round_ns = calloc(sizeof(uint64_t), rounds);
+	uint64_t elapsed = 0;
+	for (int r = 0; r < rounds; r++) {
+		FanoutNode root = { depth, data };
+		uint64_t start = tpool_now_ns();
+		fanout_task(&root);
+		round_ns[r] = tpool_now_ns() - start;
+		elapsed += round_ns[r];
+	}
+	qsort(round_ns, rounds, sizeof(uint64_t), bench_cmp_u64);
+
+	TPoolStats stats;
+	tpool_stats(pool, &stats);
+	bool pinned = pool->pinned;
+	tpool_destroy(pool);
+	free(data);
+
+	uint64_t steals = 0;
+	for (int level = 0; level < TPOOL_STEAL_LEVELS; level++) {
+		steals += stats.steals[level];
+	}
+
+	printf("%-10s %-6s %14.0f %10.1f %10.1f %10.1f %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "   %" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 "\n",
+	       pin ? (pinned ? "pinned" : "pin n/a") : "floating",
+	       steal_half ? "half" : "one",
+	       (double)rounds * (double)((2ull << depth) - 1) / ((double)elapsed / 1000000000.0),
+	       (double)round_ns[rounds / 2] / 1000.0,
+	       (double)round_ns[(size_t)rounds * 99 / 100] / 1000.0,
+	       (double)round_ns[rounds - 1] / 1000.0,
+	       stats.steal_attempts,
+	       steals,
+	       stats.tasks_stolen,
+	       stats.steals[TPOOL_STEAL_SMT],
+	       stats.steals[TPOOL_STEAL_CACHE],
+	       stats.steals[TPOOL_STEAL_NODE],
+	       stats.steals[TPOOL_STEAL_REMOTE]);
+	free(round_ns);
+}
+
+static void fanout_bench_main(int argc, char **argv) {
+	int thread_count = 8;
+	int depth = 12;
+	int rounds = 200;
+	if (argc > 0) thread_count = atoi(argv[0]);
+	if (argc > 1) depth = atoi(argv[1]);
+	if (argc > 2) rounds = atoi(argv[2]);
+
+	printf("fanout: %d threads, binary tree of %" PRIu64 " tasks x %d rounds\n", thread_count, (uint64_t)(2ull << depth) - 1, rounds);
+	printf("%-10s %-6s %14s %10s %10s %10s %10s %10s %10s   %s\n",
+	       "placement", "steal", "tasks/sec", "p50_us", "p99_us", "max_us", "attempts", "steals", "stolen", "smt/cache/node/remote");
+	for (int pin = 0; pin < 2; pin++) {
+		for (int half = 0; half < 2; half++) {
+			fanout_bench(thread_count, pin, half, depth, rounds);
+			fflush(stdout);
+		}
+	}
+}
+
+/*
+	Priority benchmark
+
+	Thread 0 floods its queue with 10us background tasks, more than the workers can get through while we measure,
+	then trickles in short urgent ones every 200us and records how long each sat before it started. Done once with
+	the urgent tasks at normal priority, stuck behind the backlog, and once at high priority.
+*/
+
+static _Atomic int priority_bench_stop;
+
+static ssize_t priority_background_task(void *args) {
+	(void)args;
+	if (!atomic_load_explicit(&priority_bench_stop, memory_order_relaxed)) {
+		uint64_t end = tpool_now_ns() + 10000;
+		while (tpool_now_ns() < end) {
+			tpool__pause();
+		}
+	}
+	return 0;
+}
+
+typedef struct PrioritySample {
+	uint64_t pushed_ns;
+	uint64_t latency_ns;
+} PrioritySample;
+
+static ssize_t priority_urgent_task(void *args) {
+	PrioritySample *sample = args;
+	sample->latency_ns = tpool_now_ns() - sample->pushed_ns;
+	return 0;
+}
+
+static void priority_bench(int thread_count, int priority, int samples) {
+	TPool *pool = tpool_init(thread_count - 1);
+	atomic_store_explicit(&priority_bench_stop, 0, memory_order_relaxed);
+
+	// enough for every worker to stay busy for about twice as long as the sampling takes
+	size_t background = (size_t)(thread_count - 1) * (size_t)samples * 200 / 10 * 2;
+	TPoolTask *tasks = calloc(sizeof(TPoolTask), background);
+	for (size_t i = 0; i < background; i++) {
+		tasks[i].do_work = priority_background_task;
+	}
+	tpool_push_batch(pool, tasks, background);
+
+	PrioritySample *sample = calloc(sizeof(PrioritySample), samples);
+	for (int i = 0; i < samples; i++) {
+		usleep(200);
+		sample[i].pushed_ns = tpool_now_ns();
+		TPoolTask task = { .do_work = priority_urgent_task, .args = &sample[i] };
+		tpool_push_priority(pool, task, priority);
+	}
+
+	// whatever's left of the backlog drains straight away
+	atomic_store_explicit(&priority_bench_stop, 1, memory_order_relaxed);
+	tpool_wait(pool);
+	tpool_destroy(pool);
+	free(tasks);
+
+	uint64_t *latency = calloc(sizeof(uint64_t), samples);
+	for (int i = 0; i < samples; i++) {
+		latency[i] = sample[i].latency_ns;
+	}
+	qsort(latency, samples, sizeof(uint64_t), bench_cmp_u64);
+	printf("%-10s %12.1f %12.1f %12.1f\n",
+	       priority == TPOOL_PRIORITY_HIGH ? "high" : "normal",
+	       (double)latency[samples / 2] / 1000.0,
+	       (double)latency[(size_t)samples * 99 / 100] / 1000.0,
+	       (double)latency[samples - 1] / 1000.0);
+	free(latency);
+	free(sample);
+}
+
+static void priority_bench_main(int argc, char **argv) {
+	int thread_count = 8;
+	int samples = 1000;
+	if (argc > 0) thread_count = atoi(argv[0]);
+	if (argc > 1) samples = atoi(argv[1]);
+
+	printf("priority: %d threads, %d urgent tasks behind a backlog of 10us tasks\n", thread_count, samples);
+	printf("%-10s %12s %12s %12s\n", "priority", "p50_us", "p99_us", "max_us");
+	priority_bench(thread_count, TPOOL_PRIORITY_NORMAL, samples);
+	fflush(stdout);
+	priority_bench(thread_count, TPOOL_PRIORITY_HIGH, samples);
+	fflush(stdout);
+}
+
+/*
+	Closure benchmark
+
+	Spawning tasks that need more than a pointer's worth of state: malloc a context and free it in the task,
+	or hand the state to tpool_task_closure, for a capture that fits in the task and one that spills to the slab.
+	Each round, the children are spawned from inside a task so the spawning thread is a worker.
+
+	Then thread 0 feeds the workers spilled closures, round after round, without running many itself. Its blocks
+	come back from whoever ran them, so its slab should stop growing after the first round.
+*/
+
+typedef struct ClosureSmall {
+	uint64_t words[5];
+} ClosureSmall;
+
+typedef struct ClosureBig {
+	uint64_t words[25];
+} ClosureBig;
+
+static _Thread_local uint64_t closure_sink;
+
+static ssize_t closure_small_task(void *args) {
+	ClosureSmall *c = args;
+	for (int i = 0; i < 5; i++) closure_sink += c->words[i];
+	return 0;
+}
+
+static ssize_t closure_small_malloc_task(void *args) {
+	closure_small_task(args);
+	free(args);
+	return 0;
+}
+
+static ssize_t closure_big_task(void *args) {
+	ClosureBig *c = args;
+	for (int i = 0; i < 25; i++) closure_sink += c->words[i];
+	return 0;
+}
+
+static ssize_t closure_big_malloc_task(void *args) {
+	closure_big_task(args);
+	free(args);
+	return 0;
+}
+
+typedef struct ClosureSpawner {
+	bool big;
+	bool use_malloc;
+	int count;
+} ClosureSpawner;
+
+static ssize_t closure_spawner_task(void *args) {
+	ClosureSpawner *spawner = args;
+	TPool *pool = current_thread->pool;
+	TPoolGroup group;
+	tpool_group_init(&group);
+
+	for (int i = 0; i < spawner->count; i++) {
+		TPoolTask task;
+		if (spawner->big) {
+			ClosureBig c;
+			for (int w = 0; w < 25; w++) c.words[w] = (uint64_t)(i + w);
+			if (spawner->use_malloc) {
+				ClosureBig *ctx = malloc(sizeof(ClosureBig));
+				*ctx = c;
+				task = (TPoolTask){ .do_work = closure_big_malloc_task, .args = ctx };
+			} else {
+				task = tpool_task_closure(closure_big_task, &c, sizeof(c));
+			}
+		} else {
+			ClosureSmall c;
+			for (int w = 0; w < 5; w++) c.words[w] = (uint64_t)(i + w);
+			if (spawner->use_malloc) {
+				ClosureSmall *ctx = malloc(sizeof(ClosureSmall));
+				*ctx = c;
+				task = (TPoolTask){ .do_work = closure_small_malloc_task, .args = ctx };
+			} else {
+				task = tpool_task_closure(closure_small_task, &c, sizeof(c));
+			}
+		}
+		tpool_group_push(pool, &group, task);
+	}
+	tpool_group_wait(pool, &group);
+	return 0;
+}
+
+static double closure_bench(int thread_count, bool big, bool use_malloc, int spawners, int per_spawner) {
+	TPool *pool = tpool_init(thread_count - 1);
+	ClosureSpawner spawner = { big, use_malloc, per_spawner };
+	TPoolTask *tasks = calloc(sizeof(TPoolTask), spawners);
+	for (int i = 0; i < spawners; i++) {
+		tasks[i] = (TPoolTask){ .do_work = closure_spawner_task, .args = &spawner };
+	}
+
+	uint64_t start = tpool_now_ns();
+	tpool_push_batch(pool, tasks, spawners);
+	tpool_wait(pool);
+	uint64_t elapsed = tpool_now_ns() - start;
+
+	tpool_destroy(pool);
+	free(tasks);
+	return (double)spawners * per_spawner / ((double)elapsed / 1000000000.0);
+}
+
+static size_t closure_spill_chunks(Thread *thread) {
+	size_t chunks = 0;
+	for (TPoolSpillChunk *chunk = thread->spill_chunks; chunk; chunk = chunk->next) {
+		chunks++;
+	}
+	return chunks;
+}
+
+// Resident set in MB, or 0 where we don't know how to ask
+static double closure_rss_mb(void) {
+	double mb = 0;
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		unsigned long size, resident;
+		if (fscanf(f, "%lu %lu", &size, &resident) == 2) {
+			mb = (double)resident * (double)sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+		}
+		fclose(f);
+	}
+#endif
+	return mb;
+}
+
+// Returns false if thread 0's slab was still growing at the end
+static bool closure_producer_bench(int thread_count, int rounds, int per_round) {
+	TPool *pool = tpool_init(thread_count - 1);
+	ClosureBig c = {0};
+	size_t first_chunks = 0, chunks = 0;
+	double first_rss = 0, rss = 0;
+	for (int round = 0; round < rounds; round++) {
+		for (int i = 0; i < per_round; i++) {
+			c.words[0] = (uint64_t)i;
+			tpool_push(pool, tpool_task_closure(closure_big_task, &c, sizeof(c)));
+		}
+		tpool_wait(pool);
+
+		chunks = closure_spill_chunks(&pool->threads[0]);
+		rss = closure_rss_mb();
+		if (round == 0) {
+			first_chunks = chunks;
+			first_rss = rss;
+		}
+	}
+	tpool_destroy(pool);
+
+	bool bounded = chunks <= first_chunks * 2;
+	printf("producer: %d rounds x %d tasks, thread 0 slab %zu -> %zu chunks, rss %.1f -> %.1f MB: %s\n",
+	       rounds, per_round, first_chunks, chunks, first_rss, rss, bounded ? "ok" : "GROWING");
+	return bounded;
+}
+
+static void closure_bench_main(int argc, char **argv) {
+	int thread_count = 8;
+	if (argc > 0) thread_count = atoi(argv[0]);
+
+	printf("closure: %d threads, %d spawners x 100000 tasks\n", thread_count, thread_count * 2);
+	printf("%-10s %18s %18s\n", "capture", "malloc (tasks/sec)", "closure (tasks/sec)");
+	for (int big = 0; big < 2; big++) {
+		printf("%-10s %18.0f %18.0f\n", big ? "200 bytes" : "40 bytes",
+		       closure_bench(thread_count, big, true, thread_count * 2, 100000),
+		       closure_bench(thread_count, big, false, thread_count * 2, 100000));
+		fflush(stdout);
+	}
+	if (!closure_producer_bench(thread_count, 10, 100000)) {
+		exit(1);
+	}
+}
+
+/*
+	Inject benchmark
+
+	Threads outside the pool flooding it with empty tasks through the injection queue, one tpool_submit at a time
+	and in tpool_submit_batch batches of 64. Time runs from the producers starting until the pool has run everything.
+*/
+
+typedef struct InjectProducer {
+	pthread_t thread;
+	TPool *pool;
+	uint64_t count;
+	bool batch;
+} InjectProducer;
+
+static ssize_t inject_bench_task(void *args) {
+	(void)args;
+	return 0;
+}
+
+static void *inject_producer(void *ptr) {
+	InjectProducer *producer = ptr;
+	TPoolTask tasks[64] = {0};
+	for (int i = 0; i < 64; i++) {
+		tasks[i].do_work = inject_bench_task;
+	}
+
+	if (producer->batch) {
+		for (uint64_t i = 0; i < producer->count; i += 64) {
+			tpool_submit_batch(producer->pool, tasks, 64);
+		}
+	} else {
+		for (uint64_t i = 0; i < producer->count; i++) {
+			tpool_submit(producer->pool, tasks[0]);
+		}
+	}
+	return NULL;
+}
+
+static double inject_bench(int thread_count, int producer_count, bool batch, uint64_t per_producer) {
+	TPool *pool = tpool_init(thread_count - 1);
+	InjectProducer *producers = calloc(sizeof(InjectProducer), producer_count);
+
+	uint64_t start = tpool_now_ns();
+	for (int i = 0; i < producer_count; i++) {
+		producers[i].pool = pool;
+		producers[i].count = per_producer;
+		producers[i].batch = batch;
+		pthread_create(&producers[i].thread, NULL, inject_producer, &producers[i]);
+	}
+	for (int i = 0; i < producer_count; i++) {
+		pthread_join(producers[i].thread, NULL);
+	}
+	tpool_wait(pool);
+	uint64_t elapsed = tpool_now_ns() - start;
+
+	tpool_destroy(pool);
+	free(producers);
+	return (double)producer_count * (double)per_producer / ((double)elapsed / 1000000000.0);
+}
+
+static void inject_bench_main(int argc, char **argv) {
+	int thread_count = 8;
+	int max_producers = 16;
+	if (argc > 0) thread_count = atoi(argv[0]);
+	if (argc > 1) max_producers = atoi(argv[1]);
+
+	printf("inject: %d pool threads, 1M empty tasks per run from outside the pool\n", thread_count);
+	printf("%-10s %18s %18s\n", "producers", "submit (tasks/sec)", "batch (tasks/sec)");
+	for (int producers = 1; producers <= max_producers; producers *= 2) {
+		uint64_t per_producer = (1000000 / producers + 63) / 64 * 64;
+		printf("%-10d %18.0f %18.0f\n", producers,
+		       inject_bench(thread_count, producers, false, per_producer),
+		       inject_bench(thread_count, producers, true, per_producer));
+		fflush(stdout);
+	}
+}
+
+/*
+	Continuation benchmark
+
+	Recursive fib two ways: each task waits on a group for its two children, helping out in the meantime, or hands
+	the sum off to a continuation and returns straight away. The second never nests tasks on a worker's stack.
+*/
+
+typedef struct ContFibArgs {
+	int n;
+	int64_t *out;
+} ContFibArgs;
+
+typedef struct ContFibFrame {
+	TPoolGroup group;
+	int64_t *out;
+	int64_t a, b;
+} ContFibFrame;
+
+static ssize_t wait_fib_task(void *args) {
+	ContFibArgs *fib = args;
+	if (fib->n < 2) {
+		*fib->out = fib->n;
+		return 0;
+	}
+
+	int64_t a, b;
+	TPoolGroup group;
+	tpool_group_init(&group);
+	ContFibArgs left = { fib->n - 1, &a }, right = { fib->n - 2, &b };
+	tpool_group_push(current_thread->pool, &group, tpool_task_closure(wait_fib_task, &left, sizeof(left)));
+	tpool_group_push(current_thread->pool, &group, tpool_task_closure(wait_fib_task, &right, sizeof(right)));
+	tpool_group_wait(current_thread->pool, &group);
+	*fib->out = a + b;
+	return 0;
+}
+
+static ssize_t cont_fib_sum(void *args) {
+	ContFibFrame *frame = *(ContFibFrame **)args;
+	*frame->out = frame->a + frame->b;
+	free(frame);
+	return 0;
+}
+
+static ssize_t cont_fib_task(void *args) {
+	ContFibArgs *fib = args;
+	if (fib->n < 2) {
+		*fib->out = fib->n;
+		return 0;
+	}
+
+	TPool *pool = current_thread->pool;
+	ContFibFrame *frame = malloc(sizeof(ContFibFrame));
+	frame->out = fib->out;
+	tpool_group_init(&frame->group);
+	tpool_group_then(&frame->group, tpool_task_closure(cont_fib_sum, &frame, sizeof(frame)));
+
+	ContFibArgs left = { fib->n - 1, &frame->a }, right = { fib->n - 2, &frame->b };
+	tpool_group_push(pool, &frame->group, tpool_task_closure(cont_fib_task, &left, sizeof(left)));
+	tpool_group_push(pool, &frame->group, tpool_task_closure(cont_fib_task, &right, sizeof(right)));
+	tpool_group_seal(pool, &frame->group);
+	return 0;
+}
+
+static void cont_bench(int thread_count, int n, bool cont) {
+	TPool *pool = tpool_init(thread_count - 1);
+	int64_t result = 0;
+	ContFibArgs root = { n, &result };
+
+	uint64_t start = tpool_now_ns();
+	TPoolGroup group;
+	tpool_group_init(&group);
+	tpool_group_push(pool, &group, tpool_task_closure(cont ? cont_fib_task : wait_fib_task, &root, sizeof(root)));
+	tpool_group_wait(pool, &group);
+	uint64_t elapsed = tpool_now_ns() - start;
+
+	uint64_t tasks = tpool_tasks_pushed(pool);
+	tpool_destroy(pool);
+	printf("%-14s %10" PRId64 " %12" PRIu64 " %10.2f %16.0f\n", cont ? "continuation" : "group wait",
+	       result, tasks, (double)elapsed / 1000000.0, (double)tasks / ((double)elapsed / 1000000000.0));
+}
+
+static void cont_bench_main(int argc, char **argv) {
+	int thread_count = 8;
+	int n = 25;
+	if (argc > 0) thread_count = atoi(argv[0]);
+	if (argc > 1) n = atoi(argv[1]);
+
+	printf("cont: %d threads, fib(%d)\n", thread_count, n);
+	printf("%-14s %10s %12s %10s %16s\n", "style", "result", "tasks", "ms", "tasks/sec");
+	cont_bench(thread_count, n, false);
+	fflush(stdout);
+	cont_bench(thread_count, n, true);
+	fflush(stdout);
+}
+
+/*
+	Graph benchmark
+
+	A side by side wavefront: each cell of a grid waits on the one above and the one to its left. Builds the graph
+	once and reruns it, against building a fresh one for every run, to show what keeping the graph around saves.
+*/
+
+static _Thread_local uint64_t graph_sink;
+
+static ssize_t graph_cell_task(void *args) {
+	uint64_t x = (uintptr_t)args;
+	for (int i = 0; i < 64; i++) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	}
+	graph_sink += x;
+	return 0;
+}
+
+static TPoolGraph *graph_bench_build(int side) {
+	TPoolGraph *graph = tpool_graph_create();
+	for (int i = 0; i < side; i++) {
+		for (int j = 0; j < side; j++) {
+			TPoolTask task = { .do_work = graph_cell_task, .args = (void *)(uintptr_t)(i * side + j) };
+			int id = tpool_graph_add(graph, task);
+			if (i) tpool_graph_edge(graph, id - side, id);
+			if (j) tpool_graph_edge(graph, id - 1, id);
+		}
+	}
+	return graph;
+}
+
+static void graph_bench(int thread_count, int side, int runs, bool rebuild) {
+	TPool *pool = tpool_init(thread_count - 1);
+
+	uint64_t build_ns = 0;
+	uint64_t start = tpool_now_ns();
+	TPoolGraph *graph = NULL;
+	for (int r = 0; r < runs; r++) {
+		if (!graph || rebuild) {
+			uint64_t build_start = tpool_now_ns();
+			if (graph) tpool_graph_destroy(graph);
+			graph = graph_bench_build(side);
+			build_ns += tpool_now_ns() - build_start;
+		}
+		tpool_graph_run(pool, graph);
+		tpool_graph_wait(pool, graph);
+	}
+	uint64_t elapsed = tpool_now_ns() - start;
+
+	tpool_graph_destroy(graph);
+	tpool_destroy(pool);
+
+	double tasks = (double)side * side * runs;
+	printf("%-10s %10.2f %10.2f %12.0f %16.0f\n", rebuild ? "rebuild" : "rerun",
+	       (double)elapsed / 1000000.0, (double)build_ns / 1000000.0,
+	       runs / ((double)elapsed / 1000000000.0), tasks / ((double)elapsed / 1000000000.0));
+}
+
+static void graph_bench_main(int argc, char **argv) {
+	int thread_count = 8;
+	int side = 64;
+	int runs = 200;
+	if (argc > 0) thread_count = atoi(argv[0]);
+	if (argc > 1) side = atoi(argv[1]);
+	if (argc > 2) runs = atoi(argv[2]);
+
+	printf("graph: %d threads, %dx%d grid, %d runs\n", thread_count, side, side, runs);
+	printf("%-10s %10s %10s %12s %16s\n", "graph", "ms", "build ms", "runs/sec", "tasks/sec");
+	graph_bench(thread_count, side, runs, true);
+	fflush(stdout);
+	graph_bench(thread_count, side, runs, false);
+	fflush(stdout);
+}
+
+/*
+	Stats
+
+	Runs the fanout tree and prints every thread's counters side by side, which is where load imbalance shows up:
+	one thread doing most of the executing, or everyone else's steals coming up empty.
+*/
+
+static void stats_bench_main(int argc, char **argv) {
+	int thread_count = 8;
+	int depth = 12;
+	int rounds = 50;
+	if (argc > 0) thread_count = atoi(argv[0]);
+	if (argc > 1) depth = atoi(argv[1]);
+	if (argc > 2) rounds = atoi(argv[2]);
+
+	TPool *pool = tpool_init(thread_count - 1);
+	uint64_t *data = calloc(sizeof(uint64_t), (size_t)FANOUT_LEAF_WORDS << depth);
+	for (int r = 0; r < rounds; r++) {
+		FanoutNode root = { depth, data };
+		fanout_task(&root);
+	}
+
+	printf("stats: %d threads, fanout depth %d, %d rounds\n", thread_count, depth, rounds);
+	printf("%-7s %10s %10s %10s %10s %8s %8s %8s %8s %10s %10s\n", "thread", "executed", "pushed", "attempts",
+	       "stolen", "lost", "parks", "unparks", "wakes", "idle ms", "peak");
+	for (int i = 0; i <= thread_count; i++) {
+		TPoolStats stats;
+		if (i < thread_count) {
+			tpool_thread_stats(pool, i, &stats);
+		} else {
+			tpool_stats(pool, &stats);
+		}
+
+		char name[16];
+		snprintf(name, sizeof(name), i < thread_count ? "%d" : "total", i);
+		printf("%-7s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64
+		       " %8" PRIu64 " %10.2f %10" PRIu64 "\n", name, stats.tasks_executed, stats.tasks_pushed,
+		       stats.steal_attempts, stats.tasks_stolen, stats.steals_lost, stats.parks, stats.unparks, stats.wakes,
+		       (double)(stats.spin_ns + stats.park_ns) / 1000000.0, stats.peak_queue_depth);
+	}
+	fflush(stdout);
+
+	tpool_destroy(pool);
+	free(data);
+}
+
+/*
+	Schedule
+
+	Runs the fanout tree under a fixed schedule, for bisecting: the first run with a file records whatever the pool
+	comes up with into it, and runs after that replay it, so each build gets timed on the same interleaving. Without
+	a file it records and replays in memory. Free running and seeded times are printed alongside for how much
+	taking turns costs.
+*/
+
+static double schedule_bench(int thread_count, int depth, int rounds, TPoolSchedule *schedule) {
+	TPoolOptions opts = {0};
+	opts.child_thread_count = thread_count - 1;
+	opts.schedule = schedule;
+	TPool *pool = tpool_init_opts(&opts);
+	uint64_t *data = calloc(sizeof(uint64_t), (size_t)FANOUT_LEAF_WORDS << depth);
+
+	uint64_t start = tpool_now_ns();
+	for (int r = 0; r < rounds; r++) {
+		FanoutNode root = { depth, data };
+		fanout_task(&root);
+	}
+	uint64_t elapsed = tpool_now_ns() - start;
+
+	tpool_destroy(pool);
+	free(data);
+	return (double)elapsed / 1000000.0;
+}
+
+static void schedule_bench_main(int argc, char **argv) {
+	int thread_count = 4;
+	int depth = 8;
+	int rounds = 20;
+	const char *path = NULL;
+	if (argc > 0) thread_count = atoi(argv[0]);
+	if (argc > 1) depth = atoi(argv[1]);
+	if (argc > 2) rounds = atoi(argv[2]);
+	if (argc > 3) path = argv[3];
+
+	printf("schedule: %d threads, fanout depth %d, %d rounds\n", thread_count, depth, rounds);
+	printf("%-10s %10s %10s %10s\n", "schedule", "ms", "picks", "diverged");
+	printf("%-10s %10.2f %10s %10s\n", "free", schedule_bench(thread_count, depth, rounds, NULL), "-", "-");
+
+	TPoolSchedule *schedule = path ? tpool_schedule_load(path) : NULL;
+	if (!schedule) {
+		schedule = tpool_schedule_create(0);
+		double ms = schedule_bench(thread_count, depth, rounds, schedule);
+		printf("%-10s %10.2f %10zu %10s\n", "record", ms, schedule->pick_count, "-");
+		if (path && !tpool_schedule_save(schedule, path)) {
+			printf("couldn't save the schedule to %s\n", path);
+		}
+		tpool_schedule_rewind(schedule);
+	}
+	double ms = schedule_bench(thread_count, depth, rounds, schedule);
+	printf("%-10s %10.2f %10zu %10s\n", "replay", ms, schedule->pick_count, tpool_schedule_diverged(schedule) ? "yes" : "no");
+	fflush(stdout);
+	tpool_schedule_destroy(schedule);
+
+	for (uint64_t seed = 1; seed <= 3; seed++) {
+		TPoolSchedule *seeded = tpool_schedule_create(seed);
+		char name[16];
+		snprintf(name, sizeof(name), "seed %" PRIu64, seed);
+		ms = schedule_bench(thread_count, depth, rounds, seeded);
+		printf("%-10s %10.2f %10zu %10s\n", name, ms, seeded->pick_count, "-");
+		tpool_schedule_destroy(seeded);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+	const char *mode = argc > 1 ? argv[1] : "all";
+	bool all = !strcmp(mode, "all");
+	int mode_argc = argc > 2 ? argc - 2 : 0;
+	char **mode_argv = argv + 2;
+
+	if (all || !strcmp(mode, "check")) check_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "deque")) deque_bench_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "park"))   park_bench_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "submit")) submit_bench_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "fanout")) fanout_bench_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "priority")) priority_bench_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "closure")) closure_bench_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "inject")) inject_bench_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "cont")) cont_bench_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "graph")) graph_bench_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "stats")) stats_bench_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "schedule")) schedule_bench_main(mode_argc, mode_argv);
+
+	return 0;
+}
@@ -1 +1,6 @@
 clang -g -O3 -o pool -ldl -lpthread -rdynamic -finstrument-functions main.c
+clang -g -O3 -o bench -lpthread bench.c
+clang -g -O3 -o pool_sched -ldl -lpthread -rdynamic main.c
+clang -g -O3 -o suite -lpthread suite.c
+clang -g -O3 -o trace_bench -ldl -lpthread -rdynamic trace_bench.c
+clang -g -O3 -o spall_convert spall_convert.c
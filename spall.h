@@ -45,7 +45,7 @@ TODO: Optional Helper APIs:
 
 typedef struct SpallHeader {
     uint64_t magic_header; // = 0x0BADF00D
-    uint64_t version; // = 1
+    uint64_t version; // = 1, or 2 for a chunked stream (see below)
     double   timestamp_unit;
     uint64_t must_be_0;
 } SpallHeader;
@@ -60,6 +60,8 @@ enum {
     SpallEventType_Instant             = 5,
 
     SpallEventType_Overwrite_Timestamp = 6, // Retroactively change timestamp units - useful for incrementally improving RDTSC frequency.
+
+    SpallEventType_Chunk               = 7, // Version 2 only, and the only thing at the top level of a version 2 stream.
 };
 
 typedef struct SpallBeginEvent {
@@ -87,8 +89,43 @@ typedef struct SpallEndEvent {
     double   when;
 } SpallEndEvent;
 
+/*
+  Version 2 streams are a sequence of chunks, each one buffer's worth of events from a single pid + tid, so those
+  are only written once per chunk. Timestamps are integer ticks (timestamp_unit still converts them), stored as the
+  delta from the previous event in the chunk, or from base for the first one.
+
+  Every event starts with one byte: its kind in the top two bits, then the low 5 bits of the delta, with bit 5 set
+  if the rest of the delta follows as a LEB128 varint. An End is nothing but that, so 1 byte within 32 ticks and 2
+  within 4096. A Begin carries on with name_length, args_length, the name and the args.
+
+  Names that come up over and over can be interned instead: a Name record gives one an id (a varint) once, and from
+  then on a BeginRef carries the id where a Begin would carry the name. Ids belong to the pid + tid they were defined
+  on and hold across its chunks; defining one again replaces it.
+*/
+typedef struct SpallChunkHeader {
+    uint8_t  type; // = SpallEventType_Chunk
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t base;
+    uint32_t length; // bytes of events following the header
+} SpallChunkHeader;
+
 #pragma pack(pop)
 
+enum {
+    SpallV2_End      = 0 << 6,
+    SpallV2_Begin    = 1 << 6,
+    SpallV2_BeginRef = 2 << 6, // then id, args_length, args
+    SpallV2_Name     = 3 << 6, // delta is always 0, then id, name_length, name
+};
+#define SPALL_V2_KIND_MASK     0xC0
+#define SPALL_V2_DELTA_MORE    0x20
+#define SPALL_V2_DELTA_MAX     10 // lead byte and varint for a full 64-bit delta
+#define SPALL_V2_ID_MAX        5  // varint for a 32-bit id
+#define SPALL_V2_BEGIN_MAX     (SPALL_V2_DELTA_MAX + 2 + 255 + 255)
+#define SPALL_V2_BEGIN_REF_MAX (SPALL_V2_DELTA_MAX + SPALL_V2_ID_MAX + 1 + 255)
+#define SPALL_V2_NAME_MAX      (1 + SPALL_V2_ID_MAX + 1 + 255)
+
 typedef struct SpallProfile SpallProfile;
 
 // Important!: If you define your own callbacks, mark them SPALL_NOINSTRUMENT!
@@ -99,6 +136,7 @@ typedef void (*SpallCloseCallback)(SpallProfile *self);
 struct SpallProfile {
     double timestamp_unit;
     bool is_json;
+    uint32_t version;
     SpallWriteCallback write;
     SpallFlushCallback flush;
     SpallCloseCallback close;
@@ -114,6 +152,12 @@ typedef struct SpallBuffer {
     // Internal data - don't assign this
     size_t head;
     SpallProfile *ctx;
+
+    // Version 2 only: who the chunk belongs to, and the timestamps the deltas run from
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t base;
+    uint64_t last;
 } SpallBuffer;
 
 #ifdef __cplusplus
@@ -166,6 +210,40 @@ SPALL_FN void spall__file_close(SpallProfile *ctx) {
     ctx->data = NULL;
 }
 
+SPALL_FN size_t spall_build_chunk_header(void *buffer, size_t rem_size, uint32_t pid, uint32_t tid, uint64_t base, uint32_t length) {
+    size_t header_size = sizeof(SpallChunkHeader);
+    if (header_size > rem_size) {
+        return 0;
+    }
+
+    SpallChunkHeader *header = (SpallChunkHeader *)buffer;
+    header->type = SpallEventType_Chunk;
+    header->pid = pid;
+    header->tid = tid;
+    header->base = base;
+    header->length = length;
+    return header_size;
+}
+
+// How much of wb->data is ready to be written out. For version 2 that means filling in the chunk header that
+// heads the buffer, and nothing at all if there are no events after it.
+SPALL_FN size_t spall_buffer_seal(SpallProfile *ctx, SpallBuffer *wb) {
+    if (!ctx || ctx->version < 2) return wb->head;
+    if (wb->head <= sizeof(SpallChunkHeader)) return 0;
+    spall_build_chunk_header(wb->data, wb->length, wb->pid, wb->tid, wb->base, (uint32_t)(wb->head - sizeof(SpallChunkHeader)));
+    return wb->head;
+}
+
+// Start the buffer over once it's been written out (or handed off to be)
+SPALL_FN void spall_buffer_restart(SpallProfile *ctx, SpallBuffer *wb) {
+    if (!ctx || ctx->version < 2) {
+        wb->head = 0;
+        return;
+    }
+    wb->head = sizeof(SpallChunkHeader);
+    wb->base = wb->last;
+}
+
 SPALL_FN SPALL_FORCEINLINE bool spall__buffer_flush(SpallProfile *ctx, SpallBuffer *wb) {
     // precon: wb
     // precon: wb->data
@@ -175,17 +253,18 @@ SPALL_FN SPALL_FORCEINLINE bool spall__buffer_flush(SpallProfile *ctx, SpallBuff
     if (wb->ctx != ctx) return false; // Buffer must be bound to this context (or to NULL)
 #endif
 
-    if (wb->head && ctx) {
+    size_t length = spall_buffer_seal(ctx, wb);
+    if (length && ctx) {
         SPALL_BUFFER_PROFILE_BEGIN();
         if (!ctx->write) return false;
         if (ctx->write == spall__file_write) {
-            if (!spall__file_write(ctx, wb->data, wb->head)) return false;
+            if (!spall__file_write(ctx, wb->data, length)) return false;
         } else {
-            if (!ctx->write(ctx, wb->data, wb->head)) return false;
+            if (!ctx->write(ctx, wb->data, length)) return false;
         }
         SPALL_BUFFER_PROFILE_END("Buffer Flush");
     }
-    wb->head = 0;
+    spall_buffer_restart(ctx, wb);
     return true;
 }
 
@@ -221,8 +300,16 @@ SPALL_FN bool spall_buffer_flush(SpallProfile *ctx, SpallBuffer *wb) {
 SPALL_FN bool spall_buffer_init(SpallProfile *ctx, SpallBuffer *wb) {
     if (!spall_buffer_flush(NULL, wb)) return false;
     wb->ctx = ctx;
+    spall_buffer_restart(ctx, wb);
     return true;
 }
+SPALL_FN bool spall_buffer_init_v2(SpallProfile *ctx, SpallBuffer *wb, uint32_t tid, uint32_t pid) {
+    wb->pid = pid;
+    wb->tid = tid;
+    wb->base = 0;
+    wb->last = 0;
+    return spall_buffer_init(ctx, wb);
+}
 SPALL_FN bool spall_buffer_quit(SpallProfile *ctx, SpallBuffer *wb) {
     if (!spall_buffer_flush(ctx, wb)) return false;
     wb->ctx = NULL;
@@ -236,7 +323,7 @@ SPALL_FN bool spall_buffer_abort(SpallBuffer *wb) {
     return true;
 }
 
-SPALL_FN size_t spall_build_header(void *buffer, size_t rem_size, double timestamp_unit) {
+SPALL_FN size_t spall__build_header(void *buffer, size_t rem_size, double timestamp_unit, uint32_t version) {
     size_t header_size = sizeof(SpallHeader);
     if (header_size > rem_size) {
         return 0;
@@ -244,11 +331,14 @@ SPALL_FN size_t spall_build_header(void *buffer, size_t rem_size, double timesta
 
     SpallHeader *header = (SpallHeader *)buffer;
     header->magic_header = 0x0BADF00D;
-    header->version = 1;
+    header->version = version;
     header->timestamp_unit = timestamp_unit;
     header->must_be_0 = 0;
     return header_size;
 }
+SPALL_FN size_t spall_build_header(void *buffer, size_t rem_size, double timestamp_unit) {
+    return spall__build_header(buffer, rem_size, timestamp_unit, 1);
+}
 SPALL_FN SPALL_FORCEINLINE size_t spall_build_begin(void *buffer, size_t rem_size, const char *name, signed long name_len, const char *args, signed long args_len, double when, uint32_t tid, uint32_t pid) {
     SpallBeginEventMax *ev = (SpallBeginEventMax *)buffer;
     uint8_t trunc_name_len = (uint8_t)SPALL_MIN(name_len, 255); // will be interpreted as truncated in the app (?)
@@ -271,6 +361,76 @@ SPALL_FN SPALL_FORCEINLINE size_t spall_build_begin(void *buffer, size_t rem_siz
 
     return ev_size;
 }
+SPALL_FN SPALL_FORCEINLINE size_t spall__build_varint(uint8_t *p, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        p[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (uint8_t)value;
+    return n;
+}
+SPALL_FN SPALL_FORCEINLINE size_t spall__build_delta(uint8_t *p, uint8_t kind, uint64_t delta) {
+    if (delta < 32) {
+        p[0] = kind | (uint8_t)delta;
+        return 1;
+    }
+    p[0] = kind | SPALL_V2_DELTA_MORE | (uint8_t)(delta & 31);
+    return 1 + spall__build_varint(p + 1, delta >> 5);
+}
+SPALL_FN SPALL_FORCEINLINE size_t spall_build_begin_v2(void *buffer, size_t rem_size, const char *name, signed long name_len, const char *args, signed long args_len, uint64_t delta) {
+    uint8_t trunc_name_len = (uint8_t)SPALL_MIN(name_len, 255);
+    uint8_t trunc_args_len = (uint8_t)SPALL_MIN(args_len, 255);
+    if (SPALL_V2_DELTA_MAX + 2 + (size_t)trunc_name_len + trunc_args_len > rem_size) {
+        return 0;
+    }
+
+    uint8_t *p = (uint8_t *)buffer;
+    size_t n = spall__build_delta(p, SpallV2_Begin, delta);
+    p[n++] = trunc_name_len;
+    p[n++] = trunc_args_len;
+    memcpy(p + n, name, trunc_name_len);
+    n += trunc_name_len;
+    memcpy(p + n, args, trunc_args_len);
+    n += trunc_args_len;
+    return n;
+}
+SPALL_FN SPALL_FORCEINLINE size_t spall_build_begin_ref_v2(void *buffer, size_t rem_size, uint32_t id, const char *args, signed long args_len, uint64_t delta) {
+    uint8_t trunc_args_len = (uint8_t)SPALL_MIN(args_len, 255);
+    if (SPALL_V2_DELTA_MAX + SPALL_V2_ID_MAX + 1 + (size_t)trunc_args_len > rem_size) {
+        return 0;
+    }
+
+    uint8_t *p = (uint8_t *)buffer;
+    size_t n = spall__build_delta(p, SpallV2_BeginRef, delta);
+    n += spall__build_varint(p + n, id);
+    p[n++] = trunc_args_len;
+    memcpy(p + n, args, trunc_args_len);
+    n += trunc_args_len;
+    return n;
+}
+SPALL_FN size_t spall_build_name_v2(void *buffer, size_t rem_size, uint32_t id, const char *name, signed long name_len) {
+    uint8_t trunc_name_len = (uint8_t)SPALL_MIN(name_len, 255);
+    if (1 + SPALL_V2_ID_MAX + 1 + (size_t)trunc_name_len > rem_size) {
+        return 0;
+    }
+
+    uint8_t *p = (uint8_t *)buffer;
+    size_t n = 0;
+    p[n++] = SpallV2_Name;
+    n += spall__build_varint(p + n, id);
+    p[n++] = trunc_name_len;
+    memcpy(p + n, name, trunc_name_len);
+    n += trunc_name_len;
+    return n;
+}
+SPALL_FN SPALL_FORCEINLINE size_t spall_build_end_v2(void *buffer, size_t rem_size, uint64_t delta) {
+    if (SPALL_V2_DELTA_MAX > rem_size) {
+        return 0;
+    }
+    return spall__build_delta((uint8_t *)buffer, SpallV2_End, delta);
+}
+
 SPALL_FN SPALL_FORCEINLINE size_t spall_build_end(void *buffer, size_t rem_size, double when, uint32_t tid, uint32_t pid) {
     size_t ev_size = sizeof(SpallEndEvent);
     if (ev_size > rem_size) {
@@ -293,17 +453,19 @@ SPALL_FN void spall_quit(SpallProfile *ctx) {
     memset(ctx, 0, sizeof(*ctx));
 }
 
-SPALL_FN SpallProfile spall_init_callbacks(double timestamp_unit,
-                                           SpallWriteCallback write,
-                                           SpallFlushCallback flush,
-                                           SpallCloseCallback close,
-                                           void *userdata,
-                                           bool is_json) {
+SPALL_FN SpallProfile spall__init_callbacks(double timestamp_unit,
+                                            SpallWriteCallback write,
+                                            SpallFlushCallback flush,
+                                            SpallCloseCallback close,
+                                            void *userdata,
+                                            bool is_json,
+                                            uint32_t version) {
     SpallProfile ctx;
     memset(&ctx, 0, sizeof(ctx));
     if (timestamp_unit < 0) return ctx;
     ctx.timestamp_unit = timestamp_unit;
     ctx.is_json = is_json;
+    ctx.version = version;
     ctx.data = userdata;
     ctx.write = write;
     ctx.flush = flush;
@@ -313,14 +475,30 @@ SPALL_FN SpallProfile spall_init_callbacks(double timestamp_unit,
         if (!ctx.write(&ctx, "{\"traceEvents\":[\n", sizeof("{\"traceEvents\":[\n") - 1)) { spall_quit(&ctx); return ctx; }
     } else {
         SpallHeader header;
-        size_t len = spall_build_header(&header, sizeof(header), timestamp_unit);
+        size_t len = spall__build_header(&header, sizeof(header), timestamp_unit, version);
         if (!ctx.write(&ctx, &header, len)) { spall_quit(&ctx); return ctx; }
     }
 
     return ctx;
 }
 
-SPALL_FN SpallProfile spall_init_file_ex(const char *filename, double timestamp_unit, bool is_json) {
+SPALL_FN SpallProfile spall_init_callbacks(double timestamp_unit,
+                                           SpallWriteCallback write,
+                                           SpallFlushCallback flush,
+                                           SpallCloseCallback close,
+                                           void *userdata,
+                                           bool is_json) {
+    return spall__init_callbacks(timestamp_unit, write, flush, close, userdata, is_json, 1);
+}
+SPALL_FN SpallProfile spall_init_callbacks_v2(double timestamp_unit,
+                                              SpallWriteCallback write,
+                                              SpallFlushCallback flush,
+                                              SpallCloseCallback close,
+                                              void *userdata) {
+    return spall__init_callbacks(timestamp_unit, write, flush, close, userdata, false, 2);
+}
+
+SPALL_FN SpallProfile spall__init_file(const char *filename, double timestamp_unit, bool is_json, uint32_t version) {
     SpallProfile ctx;
     memset(&ctx, 0, sizeof(ctx));
     if (!filename) return ctx;
@@ -330,12 +508,149 @@ SPALL_FN SpallProfile spall_init_file_ex(const char *filename, double timestamp_
         ctx.data = fopen(filename, "ab");
     }
     if (!ctx.data) { spall_quit(&ctx); return ctx; }
-    ctx = spall_init_callbacks(timestamp_unit, spall__file_write, spall__file_flush, spall__file_close, ctx.data, is_json);
+    ctx = spall__init_callbacks(timestamp_unit, spall__file_write, spall__file_flush, spall__file_close, ctx.data, is_json, version);
     return ctx;
 }
 
+SPALL_FN SpallProfile spall_init_file_ex(const char *filename, double timestamp_unit, bool is_json) { return spall__init_file(filename, timestamp_unit, is_json, 1); }
+
 SPALL_FN SpallProfile spall_init_file     (const char* filename, double timestamp_unit) { return spall_init_file_ex(filename, timestamp_unit, false); }
 SPALL_FN SpallProfile spall_init_file_json(const char* filename, double timestamp_unit) { return spall_init_file_ex(filename, timestamp_unit, true); }
+SPALL_FN SpallProfile spall_init_file_v2  (const char* filename, double timestamp_unit) { return spall__init_file(filename, timestamp_unit, false, 2); }
+
+#if !defined(_WIN32)
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Memory-mapped file writer. Every write reserves its bytes in the file with one atomic add and copies straight
+// into the mapping, so any number of threads can flush at once without a lock and without going through stdio.
+// The file is grown and mapped a whole extent at a time, which is the only thing that takes a lock. Binary only.
+#ifndef SPALL_MMAP_EXTENT_SIZE
+#define SPALL_MMAP_EXTENT_SIZE (64ull * 1024 * 1024)
+#endif
+#ifndef SPALL_MMAP_MAX_EXTENTS
+#define SPALL_MMAP_MAX_EXTENTS 16384 // 1TB of trace at the default extent size
+#endif
+
+typedef struct SpallMmapFile {
+    int fd;
+    uint64_t head; // atomic: the next unreserved byte
+    uint64_t size; // under grow_lock
+    pthread_mutex_t grow_lock;
+    uint8_t *extents[SPALL_MMAP_MAX_EXTENTS]; // atomic: extent i maps [i, i + 1) * SPALL_MMAP_EXTENT_SIZE, or NULL
+} SpallMmapFile;
+
+SPALL_FN uint8_t *spall__mmap_extent(SpallMmapFile *f, uint64_t idx, bool wait) {
+    if (idx >= SPALL_MMAP_MAX_EXTENTS) return NULL;
+    if (wait) {
+        pthread_mutex_lock(&f->grow_lock);
+    } else if (pthread_mutex_trylock(&f->grow_lock)) {
+        return NULL;
+    }
+
+    uint8_t *base = __atomic_load_n(&f->extents[idx], __ATOMIC_ACQUIRE);
+    if (!base) {
+        uint64_t offset = idx * SPALL_MMAP_EXTENT_SIZE;
+        uint64_t end = offset + SPALL_MMAP_EXTENT_SIZE;
+        bool sized = true;
+        if (end > f->size) {
+#ifdef __linux__
+            // actually allocate the blocks, so a full disk fails here instead of SIGBUSing a writer later
+            sized = posix_fallocate(f->fd, (off_t)f->size, (off_t)(end - f->size)) == 0;
+#else
+            sized = ftruncate(f->fd, (off_t)end) == 0;
+#endif
+            if (sized) f->size = end;
+        }
+        void *p = sized ? mmap(NULL, SPALL_MMAP_EXTENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, (off_t)offset) : MAP_FAILED;
+        if (p != MAP_FAILED) {
+            base = (uint8_t *)p;
+            __atomic_store_n(&f->extents[idx], base, __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_mutex_unlock(&f->grow_lock);
+    return base;
+}
+
+SPALL_FN bool spall__mmap_write(SpallProfile *ctx, const void *p, size_t n) {
+    SpallMmapFile *f = (SpallMmapFile *)ctx->data;
+    if (!f) return false;
+
+    uint64_t offset = __atomic_fetch_add(&f->head, (uint64_t)n, __ATOMIC_RELAXED);
+    const uint8_t *src = (const uint8_t *)p;
+    while (n) {
+        uint64_t idx = offset / SPALL_MMAP_EXTENT_SIZE;
+        uint64_t within = offset % SPALL_MMAP_EXTENT_SIZE;
+        size_t len = (size_t)SPALL_MIN((uint64_t)n, SPALL_MMAP_EXTENT_SIZE - within);
+        if (idx >= SPALL_MMAP_MAX_EXTENTS) return false;
+
+        uint8_t *base = __atomic_load_n(&f->extents[idx], __ATOMIC_ACQUIRE);
+        if (!base && !(base = spall__mmap_extent(f, idx, true))) return false;
+        memcpy(base + within, src, len);
+
+        // Past halfway through an extent, map the next one if nobody else is already, so whoever gets there first
+        // doesn't have to stop and do it
+        if (within + len > SPALL_MMAP_EXTENT_SIZE / 2 && idx + 1 < SPALL_MMAP_MAX_EXTENTS &&
+            !__atomic_load_n(&f->extents[idx + 1], __ATOMIC_RELAXED)) {
+            spall__mmap_extent(f, idx + 1, false);
+        }
+
+        offset += len;
+        src += len;
+        n -= len;
+    }
+    return true;
+}
+SPALL_FN bool spall__mmap_flush(SpallProfile *ctx) {
+    SpallMmapFile *f = (SpallMmapFile *)ctx->data;
+    if (!f) return false;
+    for (uint64_t i = 0; i < SPALL_MMAP_MAX_EXTENTS; i++) {
+        uint8_t *base = __atomic_load_n(&f->extents[i], __ATOMIC_ACQUIRE);
+        if (!base) break;
+        if (msync(base, SPALL_MMAP_EXTENT_SIZE, MS_ASYNC)) return false;
+    }
+    return true;
+}
+SPALL_FN void spall__mmap_close(SpallProfile *ctx) {
+    SpallMmapFile *f = (SpallMmapFile *)ctx->data;
+    if (!f) return;
+
+    for (uint64_t i = 0; i < SPALL_MMAP_MAX_EXTENTS; i++) {
+        if (f->extents[i]) munmap(f->extents[i], SPALL_MMAP_EXTENT_SIZE);
+    }
+    if (ftruncate(f->fd, (off_t)f->head)) {} // trim the unwritten end of the last extent
+    close(f->fd);
+    pthread_mutex_destroy(&f->grow_lock);
+    free(f);
+    ctx->data = NULL;
+}
+
+SPALL_FN SpallProfile spall__init_mmap(const char *filename, double timestamp_unit, uint32_t version) {
+    SpallProfile ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    if (!filename) return ctx;
+
+    SpallMmapFile *f = (SpallMmapFile *)calloc(1, sizeof(SpallMmapFile));
+    if (!f) return ctx;
+    f->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (f->fd < 0) { free(f); return ctx; }
+    pthread_mutex_init(&f->grow_lock, NULL);
+
+    // pre-size the file by the first extent, so the header and the first flushes don't have to
+    ctx.data = f;
+    if (!spall__mmap_extent(f, 0, true)) { spall__mmap_close(&ctx); return ctx; }
+
+    ctx = spall__init_callbacks(timestamp_unit, spall__mmap_write, spall__mmap_flush, spall__mmap_close, f, false, version);
+    return ctx;
+}
+
+SPALL_FN SpallProfile spall_init_mmap   (const char *filename, double timestamp_unit) { return spall__init_mmap(filename, timestamp_unit, 1); }
+SPALL_FN SpallProfile spall_init_mmap_v2(const char *filename, double timestamp_unit) { return spall__init_mmap(filename, timestamp_unit, 2); }
+#endif
 
 SPALL_FN bool spall_flush(SpallProfile *ctx) {
 #ifdef SPALL_DEBUG
@@ -352,6 +667,7 @@ SPALL_FN SPALL_FORCEINLINE bool spall_buffer_begin_args(SpallProfile *ctx, Spall
     if (!name) return false;
     if (name_len <= 0) return false;
     if (!wb) return false;
+    if (ctx->version >= 2) return false; // spall_buffer_begin_v2
 #endif
 
     if (ctx->is_json) {
@@ -412,11 +728,104 @@ SPALL_FN SPALL_FORCEINLINE bool spall_buffer_end_ex(SpallProfile *ctx, SpallBuff
 
 SPALL_FN bool spall_buffer_end(SpallProfile *ctx, SpallBuffer *wb, double when) { return spall_buffer_end_ex(ctx, wb, when, 0, 0); }
 
+// Version 2 events go to a buffer set up with spall_buffer_init_v2, and take timestamps in integer ticks
+SPALL_FN SPALL_FORCEINLINE uint64_t spall__buffer_delta(SpallBuffer *wb, uint64_t when) {
+    // deltas are unsigned, so a timestamp from before the last one (say, from another core's TSC) lands on it
+    uint64_t delta = when > wb->last ? when - wb->last : 0;
+    wb->last += delta;
+    return delta;
+}
+
+SPALL_FN SPALL_FORCEINLINE bool spall_buffer_begin_v2(SpallProfile *ctx, SpallBuffer *wb, const char *name, signed long name_len, const char *args, signed long args_len, uint64_t when) {
+#ifdef SPALL_DEBUG
+    if (!ctx) return false;
+    if (!name) return false;
+    if (name_len <= 0) return false;
+    if (!wb) return false;
+    if (ctx->version < 2) return false;
+#endif
+
+    if ((wb->head + SPALL_V2_BEGIN_MAX) > wb->length) {
+        if (!spall__buffer_flush(ctx, wb)) {
+            return false;
+        }
+    }
+
+    wb->head += spall_build_begin_v2((char *)wb->data + wb->head, wb->length - wb->head, name, name_len, args, args_len, spall__buffer_delta(wb, when));
+    return true;
+}
+
+// Gives name an id for the rest of wb's pid + tid; picking ids (and remembering which are defined) is up to you
+SPALL_FN bool spall_buffer_name_v2(SpallProfile *ctx, SpallBuffer *wb, uint32_t id, const char *name, signed long name_len) {
+#ifdef SPALL_DEBUG
+    if (!ctx) return false;
+    if (!name) return false;
+    if (name_len <= 0) return false;
+    if (!wb) return false;
+    if (ctx->version < 2) return false;
+#endif
+
+    if ((wb->head + SPALL_V2_NAME_MAX) > wb->length) {
+        if (!spall__buffer_flush(ctx, wb)) {
+            return false;
+        }
+    }
+
+    wb->head += spall_build_name_v2((char *)wb->data + wb->head, wb->length - wb->head, id, name, name_len);
+    return true;
+}
+
+SPALL_FN SPALL_FORCEINLINE bool spall_buffer_begin_ref_v2(SpallProfile *ctx, SpallBuffer *wb, uint32_t id, const char *args, signed long args_len, uint64_t when) {
+#ifdef SPALL_DEBUG
+    if (!ctx) return false;
+    if (!wb) return false;
+    if (ctx->version < 2) return false;
+#endif
+
+    if ((wb->head + SPALL_V2_BEGIN_REF_MAX) > wb->length) {
+        if (!spall__buffer_flush(ctx, wb)) {
+            return false;
+        }
+    }
+
+    wb->head += spall_build_begin_ref_v2((char *)wb->data + wb->head, wb->length - wb->head, id, args, args_len, spall__buffer_delta(wb, when));
+    return true;
+}
+
+SPALL_FN SPALL_FORCEINLINE bool spall_buffer_end_v2(SpallProfile *ctx, SpallBuffer *wb, uint64_t when) {
+#ifdef SPALL_DEBUG
+    if (!ctx) return false;
+    if (!wb) return false;
+    if (ctx->version < 2) return false;
+#endif
+
+    if ((wb->head + SPALL_V2_DELTA_MAX) > wb->length) {
+        if (!spall__buffer_flush(ctx, wb)) {
+            return false;
+        }
+    }
+
+    wb->head += spall_build_end_v2((char *)wb->data + wb->head, wb->length - wb->head, spall__buffer_delta(wb, when));
+    return true;
+}
+
 SPALL_FN SPALL_FORCEINLINE void spall__buffer_profile(SpallProfile *ctx, SpallBuffer *wb, double spall_time_begin, double spall_time_end, const char *name, int name_len) {
     // precon: ctx
     // precon: ctx->write
     char temp_buffer_data[2048];
     SpallBuffer temp_buffer = { temp_buffer_data, sizeof(temp_buffer_data) };
+    if (ctx->version >= 2) {
+        temp_buffer.ctx = ctx;
+        temp_buffer.tid = (uint32_t)(uintptr_t)wb->data;
+        temp_buffer.pid = 4222222222;
+        temp_buffer.base = temp_buffer.last = (uint64_t)spall_time_begin;
+        spall_buffer_restart(ctx, &temp_buffer);
+        if (!spall_buffer_begin_v2(ctx, &temp_buffer, name, name_len, "", 0, (uint64_t)spall_time_begin)) return;
+        if (!spall_buffer_end_v2(ctx, &temp_buffer, (uint64_t)spall_time_end)) return;
+        size_t length = spall_buffer_seal(ctx, &temp_buffer);
+        if (ctx->write) ctx->write(ctx, temp_buffer_data, length);
+        return;
+    }
     if (!spall_buffer_begin_ex(ctx, &temp_buffer, name, name_len, spall_time_begin, (uint32_t)(uintptr_t)wb->data, 4222222222)) return;
     if (!spall_buffer_end_ex(ctx, &temp_buffer, spall_time_end, (uint32_t)(uintptr_t)wb->data, 4222222222)) return;
     if (ctx->write) ctx->write(ctx, temp_buffer_data, temp_buffer.head);
@@ -8,6 +8,7 @@ extern "C" {
 #define _GNU_SOURCE
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 typedef struct {
 	char *str;
@@ -17,6 +18,7 @@ typedef struct {
 typedef struct {
 	void *addr;
 	Name name;
+	bool interned; // the thread's v2 stream has had a Name record for this entry's id
 } SymEntry;
 
 typedef struct {
@@ -39,6 +41,13 @@ void spall_auto_init(char *filename);
 void spall_auto_quit(void);
 void spall_auto_thread_init(uint32_t _tid, size_t buffer_size, int64_t symbol_cache_size);
 void spall_auto_thread_quit(void);
+
+// Events of your own, with or without -finstrument-functions. They go on the calling thread's buffer, so only
+// between spall_auto_thread_init and spall_auto_thread_quit, anywhere else they're dropped.
+void spall_auto_begin(const char *name, int name_len, const char *args, int args_len);
+void spall_auto_begin_fn(void *fn, const char *args, int args_len); // named after the function at fn
+void spall_auto_end(void);
+void spall_auto_mark(const char *name, int name_len, const char *args, int args_len); // zero-length span
 #if _MSC_VER && !__clang__
 #ifndef _PROCESSTHREADSAPI_H_
 extern __declspec(dllimport) int(__stdcall TlsSetValue)(unsigned long dwTlsIndex, void* lpTlsValue);
@@ -57,6 +66,41 @@ extern unsigned long spall_auto__tls_index; // DWORD
 #define SPALL_DEFAULT_BUFFER_SIZE (64 * 1024 * 1024)
 #define SPALL_DEFAULT_SYMBOL_CACHE_SIZE (100000)
 
+// A thread's buffer_size is split into this many buffers. When one fills it goes to the writer thread and the
+// thread carries on in the next, so it only ever waits on disk if it laps the writer.
+#ifndef SPALL_AUTO_BUFFER_COUNT
+#define SPALL_AUTO_BUFFER_COUNT 4
+#endif
+
+// The buffer is only reserved up front, and committed this much at a time ahead of the write head, so an idle
+// thread costs address space instead of memory. Keep it a multiple of 64KB.
+#ifndef SPALL_AUTO_COMMIT_SIZE
+#define SPALL_AUTO_COMMIT_SIZE (1024 * 1024)
+#endif
+
+// 1 to commit and fault in the whole buffer at thread init instead (MAP_POPULATE on Linux), trading spin-up time
+// and memory for never stopping to commit
+#ifndef SPALL_AUTO_POPULATE
+#define SPALL_AUTO_POPULATE 0
+#endif
+
+// 1 to ask for transparent hugepages behind the buffer (Linux only)
+#ifndef SPALL_AUTO_HUGEPAGES
+#define SPALL_AUTO_HUGEPAGES 0
+#endif
+
+// 1 to write the trace through spall_init_mmap instead of a FILE. Worth it when more than the one writer thread
+// writes to spall_ctx (see the write mode of trace_bench); a lone writer streams faster through write(2).
+#ifndef SPALL_AUTO_MMAP
+#define SPALL_AUTO_MMAP 0
+#endif
+
+// 1 to write a version 2 stream: a fraction of the size, but it has to go through spall_convert before the viewer
+// can open it
+#ifndef SPALL_AUTO_V2
+#define SPALL_AUTO_V2 0
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -87,14 +131,84 @@ static _Thread_local bool spall_thread_running = false;
 #include <time.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/mman.h>
+
+static pthread_t spall_writer;
+static pthread_mutex_t spall_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spall_writer_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t spall_writer_done = PTHREAD_COND_INITIALIZER;
+#define spall_auto__lock() pthread_mutex_lock(&spall_writer_lock)
+#define spall_auto__unlock() pthread_mutex_unlock(&spall_writer_lock)
+#define spall_auto__wait(cond) pthread_cond_wait(cond, &spall_writer_lock)
+#define spall_auto__broadcast(cond) pthread_cond_broadcast(cond)
+#define spall_auto__writer_start(routine) (pthread_create(&spall_writer, NULL, routine, NULL) == 0)
+#define spall_auto__writer_join() pthread_join(spall_writer, NULL)
 #else
 static inline unsigned long __builtin_clzl(uint64_t x) { unsigned long result; _BitScanReverse64(&result, x); return result ^ 63; }
 static HANDLE process;
 #if _MSC_VER && !__clang__
 static DWORD spall_auto__tls_index = 0xFFFFFFFF;
 #endif
+
+static HANDLE spall_writer;
+static SRWLOCK spall_writer_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE spall_writer_wake = CONDITION_VARIABLE_INIT;
+static CONDITION_VARIABLE spall_writer_done = CONDITION_VARIABLE_INIT;
+#define spall_auto__lock() AcquireSRWLockExclusive(&spall_writer_lock)
+#define spall_auto__unlock() ReleaseSRWLockExclusive(&spall_writer_lock)
+#define spall_auto__wait(cond) SleepConditionVariableSRW(cond, &spall_writer_lock, INFINITE, 0)
+#define spall_auto__broadcast(cond) WakeAllConditionVariable(cond)
+#define spall_auto__writer_start(routine) ((spall_writer = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)(routine), NULL, 0, NULL)) != NULL)
+#define spall_auto__writer_join() (WaitForSingleObject(spall_writer, INFINITE), CloseHandle(spall_writer))
 #endif
 
+// One of a thread's SPALL_AUTO_BUFFER_COUNT buffers. Everything but data, length and committed is under
+// spall_writer_lock.
+typedef struct SpallAutoChunk SpallAutoChunk;
+struct SpallAutoChunk {
+	uint8_t *data;
+	size_t length;
+	size_t committed; // how much of it is backed by memory yet, only touched by the owner
+	size_t head; // what the writer should write out of it
+	bool busy; // queued for or being written by the writer, so the owner can't reuse it yet
+	SpallAutoChunk *next;
+};
+
+static _Thread_local SpallAutoChunk spall_chunks[SPALL_AUTO_BUFFER_COUNT];
+static _Thread_local int spall_chunk_idx;
+
+static SpallAutoChunk *spall_writer_head;
+static SpallAutoChunk **spall_writer_tail = &spall_writer_head;
+static bool spall_writer_running;
+static bool spall_writer_quit;
+
+// Room for the biggest thing any one call below writes (a mark), so spall.h's own flush never fires on the hot path.
+// Covers the biggest version 2 write too, a Name record and the BeginRef after it.
+#define SPALL_AUTO_EVENT_MAX (sizeof(SpallBeginEventMax) + sizeof(SpallEndEvent))
+
+// Everything goes through these so the rest doesn't care which version it's writing
+SPALL_FN void spall_auto__buffer_init(SpallBuffer *wb) {
+#if SPALL_AUTO_V2
+	spall_buffer_init_v2(&spall_ctx, wb, tid, 0);
+#else
+	spall_buffer_init(&spall_ctx, wb);
+#endif
+}
+SPALL_FN SPALL_FORCEINLINE void spall_auto__begin(SpallBuffer *wb, const char *name, int name_len, const char *args, int args_len, uint64_t when) {
+#if SPALL_AUTO_V2
+	spall_buffer_begin_v2(&spall_ctx, wb, name, name_len, args, args_len, when);
+#else
+	spall_buffer_begin_args(&spall_ctx, wb, name, name_len, args, args_len, (double)when, tid, 0);
+#endif
+}
+SPALL_FN SPALL_FORCEINLINE void spall_auto__end(SpallBuffer *wb, uint64_t when) {
+#if SPALL_AUTO_V2
+	spall_buffer_end_v2(&spall_ctx, wb, when);
+#else
+	spall_buffer_end_ex(&spall_ctx, wb, (double)when, tid, 0);
+#endif
+}
+
 
 // we're not checking overflow here...Don't do stupid things with input sizes
 SPALL_FN uint64_t next_pow2(uint64_t x) {
@@ -168,8 +282,8 @@ SPALL_FN bool get_addr_name(void *addr, Name *name_ret) {
 	{
 		char temp_data[512];
 		SpallBuffer temp = { temp_data, sizeof(temp_data) };
-		spall_buffer_init(&spall_ctx, &temp);
-		double start = (double)__rdtsc();
+		spall_auto__buffer_init(&temp);
+		uint64_t start = __rdtsc();
 		DWORD64 dummy = 0;
 		if (SymFromAddr(process, (DWORD64)addr
 #if _MSC_VER && !__clang__
@@ -184,8 +298,8 @@ SPALL_FN bool get_addr_name(void *addr, Name *name_ret) {
 			*name_ret = name;
 			result = true;
 		}
-		spall_buffer_begin_args(&spall_ctx, &temp, "Symbol Resolve", sizeof("Symbol Resolve") - 1, symbol.si.Name, symbol.si.NameLen, start, tid, 0);
-		spall_buffer_end_ex(&spall_ctx, &temp, (double)__rdtsc(), tid, 0);
+		spall_auto__begin(&temp, "Symbol Resolve", sizeof("Symbol Resolve") - 1, symbol.si.Name, symbol.si.NameLen, start);
+		spall_auto__end(&temp, __rdtsc());
 		spall_buffer_quit(&spall_ctx, &temp);
 	}
 	InterlockedExchange(&sym_lock, 0);
@@ -194,7 +308,8 @@ SPALL_FN bool get_addr_name(void *addr, Name *name_ret) {
 }
 #endif
 
-SPALL_FN bool ah_insert(AddrHash *ah, void *addr, Name name) {
+// Entries are numbered in the order they went in, which makes the index a thread's v2 name id
+SPALL_FN SymEntry *ah_add(AddrHash *ah, void *addr, Name name) {
 	int addr_hash = ah_hash(addr);
 	uint64_t hv = ((uint64_t)addr_hash) & (ah->hashes.len - 1);
 	for (uint64_t i = 0; i < ah->hashes.len; i++) {
@@ -202,23 +317,31 @@ SPALL_FN bool ah_insert(AddrHash *ah, void *addr, Name name) {
 
 		int64_t e_idx = ah->hashes.arr[idx];
 		if (e_idx == -1) {
+			if (ah->entries.len == ah->entries.cap) {
+				break;
+			}
 			SymEntry entry = {.addr = addr, .name = name};
 			ah->hashes.arr[idx] = ah->entries.len;
 			ah->entries.arr[ah->entries.len] = entry;
 			ah->entries.len += 1;
-			return true;
+			return &ah->entries.arr[ah->entries.len - 1];
 		}
 
 		if ((uint64_t)ah->entries.arr[e_idx].addr == (uint64_t)addr) {
-			return true;
+			return &ah->entries.arr[e_idx];
 		}
 	}
 
 	// The symbol map is full, make the symbol map bigger!
-	return false;
+	return NULL;
+}
+
+SPALL_FN bool ah_insert(AddrHash *ah, void *addr, Name name) {
+	return ah_add(ah, addr, name) != NULL;
 }
 
-SPALL_FN bool ah_get(AddrHash *ah, void *addr, Name *name_ret) {
+// Only looks, so it's fine on the global map from any thread once load_self is done with it
+SPALL_FN SymEntry *ah_find(AddrHash *ah, void *addr) {
 	int addr_hash = ah_hash(addr);
 	uint64_t hv = ((uint64_t)addr_hash) & (ah->hashes.len - 1);
 	for (uint64_t i = 0; i < ah->hashes.len; i++) {
@@ -226,30 +349,14 @@ SPALL_FN bool ah_get(AddrHash *ah, void *addr, Name *name_ret) {
 
 		int64_t e_idx = ah->hashes.arr[idx];
 		if (e_idx == -1) {
-
-			Name name;
-			if (!get_addr_name(addr, &name)) {
-				// Failed to get a name for the address!
-				return false;
-			}
-
-			SymEntry entry = {.addr = addr, .name = name};
-			ah->hashes.arr[idx] = ah->entries.len;
-			ah->entries.arr[ah->entries.len] = entry;
-			ah->entries.len += 1;
-
-			*name_ret = name;
-			return true;
+			return NULL;
 		}
 
 		if ((uint64_t)ah->entries.arr[e_idx].addr == (uint64_t)addr) {
-			*name_ret = ah->entries.arr[e_idx].name;
-			return true;
+			return &ah->entries.arr[e_idx];
 		}
 	}
-
-	// The symbol map is full, make the symbol map bigger!
-	return false;
+	return NULL;
 }
 
 #ifdef __linux__
@@ -492,16 +599,200 @@ void load_self(AddrHash *map) {
 
 #endif
 
-SPALL_NOINSTRUMENT SPALL_FORCEINLINE void (spall_auto_thread_init)(uint32_t _tid, size_t buffer_size, int64_t symbol_cache_size) {
-	uint8_t *buffer = (uint8_t *)malloc(buffer_size);
-	spall_buffer = (SpallBuffer){ .data = buffer, .length = buffer_size };
+#if !_WIN32
+SPALL_FN uint8_t *spall_auto__mem_reserve(size_t size) {
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#if SPALL_AUTO_POPULATE && defined(MAP_POPULATE)
+	flags |= MAP_POPULATE;
+#endif
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED) return NULL;
+#if SPALL_AUTO_HUGEPAGES && defined(MADV_HUGEPAGE)
+	madvise(p, size, MADV_HUGEPAGE);
+#endif
+	return (uint8_t *)p;
+}
 
-	// removing initial page-fault bubbles to make the data a little more accurate, at the cost of thread spin-up time
-	memset(buffer, 1, buffer_size);
+// Anonymous memory commits itself on first touch, so this is just taking the page faults now instead of in the
+// middle of an event
+SPALL_FN void spall_auto__mem_commit(uint8_t *p, size_t size) {
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(p, size, MADV_POPULATE_WRITE) == 0) return; // one syscall instead of a fault per page, on 5.14+
+#endif
+	for (size_t i = 0; i < size; i += 4096) {
+		((volatile uint8_t *)p)[i] = 0;
+	}
+}
 
-	spall_buffer_init(&spall_ctx, &spall_buffer);
+SPALL_FN void spall_auto__mem_release(uint8_t *p, size_t size) {
+	munmap(p, size);
+}
+#else
+SPALL_FN uint8_t *spall_auto__mem_reserve(size_t size) {
+	return (uint8_t *)VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_READWRITE);
+}
 
+SPALL_FN void spall_auto__mem_commit(uint8_t *p, size_t size) {
+	VirtualAlloc(p, size, MEM_COMMIT, PAGE_READWRITE);
+	for (size_t i = 0; i < size; i += 4096) {
+		((volatile uint8_t *)p)[i] = 0;
+	}
+}
+
+SPALL_FN void spall_auto__mem_release(uint8_t *p, size_t size) {
+	(void)size;
+	VirtualFree(p, 0, MEM_RELEASE);
+}
+#endif
+
+// Caller updates spall_buffer.length if this is the chunk it's writing into
+SPALL_FN void spall_auto__commit(SpallAutoChunk *chunk) {
+	size_t size = SPALL_MIN(SPALL_AUTO_COMMIT_SIZE, chunk->length - chunk->committed);
+	spall_auto__mem_commit(chunk->data + chunk->committed, size);
+	chunk->committed += size;
+}
+
+#if SPALL_AUTO_BUFFER_COUNT < 2
+#error "SPALL_AUTO_BUFFER_COUNT must be at least 2, or there's nothing to write into while the writer is busy."
+#endif
+
+// Writes out a chunk that's already been sealed
+SPALL_FN void spall_auto__write_chunk(SpallAutoChunk *chunk, size_t length) {
+	SpallProfile *ctx = &spall_ctx;
+	SpallBuffer chunk_buffer = { .data = chunk->data }, *wb = &chunk_buffer;
+	(void)wb;
+	if (!length || !ctx->write) return;
+
+	// shows up as a "Buffer Flush" with SPALL_BUFFER_PROFILING, now on the writer instead of the worker
+	SPALL_BUFFER_PROFILE_BEGIN();
+	ctx->write(ctx, chunk->data, length);
+	SPALL_BUFFER_PROFILE_END("Buffer Flush");
+}
+
+// Drains full chunks in the order they were handed over, so each thread's events stay in order in the file
+SPALL_NOINSTRUMENT static void *spall_auto__writer(void *arg) {
+	(void)arg;
+	spall_auto__lock();
+	for (;;) {
+		while (!spall_writer_head && !spall_writer_quit) {
+			spall_auto__wait(&spall_writer_wake);
+		}
+		SpallAutoChunk *chunk = spall_writer_head;
+		if (!chunk) break;
+		spall_writer_head = chunk->next;
+		if (!spall_writer_head) spall_writer_tail = &spall_writer_head;
+		spall_auto__unlock();
+
+		spall_auto__write_chunk(chunk, chunk->head);
+
+		spall_auto__lock();
+		chunk->busy = false;
+		spall_auto__broadcast(&spall_writer_done);
+	}
+	spall_auto__unlock();
+	return NULL;
+}
+
+// Caller holds spall_writer_lock, and has sealed the first head bytes of the chunk
+SPALL_FN void spall_auto__submit(SpallAutoChunk *chunk, size_t head) {
+	if (!spall_writer_running) { // no writer to hand it to, so write it ourselves
+		spall_auto__write_chunk(chunk, head);
+		return;
+	}
+	chunk->head = head;
+	chunk->busy = true;
+	chunk->next = NULL;
+	*spall_writer_tail = chunk;
+	spall_writer_tail = &chunk->next;
+	spall_auto__broadcast(&spall_writer_wake);
+}
+
+SPALL_NOINSTRUMENT static void spall_auto__swap(void) {
+	SpallAutoChunk *full = &spall_chunks[spall_chunk_idx];
+	spall_chunk_idx = (spall_chunk_idx + 1) % SPALL_AUTO_BUFFER_COUNT;
+	SpallAutoChunk *next = &spall_chunks[spall_chunk_idx];
+
+	uint64_t wait_begin = 0;
+	spall_auto__lock();
+	spall_auto__submit(full, spall_buffer_seal(&spall_ctx, &spall_buffer));
+	if (next->busy) {
+		wait_begin = __rdtsc();
+		while (next->busy) {
+			spall_auto__wait(&spall_writer_done);
+		}
+	}
+	spall_auto__unlock();
+
+	// Only the first time around, after that it's all committed already
+	if (!next->committed) {
+		spall_auto__commit(next);
+	}
+	spall_buffer.data = next->data;
+	spall_buffer.length = next->committed;
+	spall_buffer_restart(&spall_ctx, &spall_buffer);
+
+	// We lapped the writer and sat there until it caught up, which had better be in the trace
+	if (wait_begin) {
+		spall_auto__begin(&spall_buffer, "Buffer Wait", sizeof("Buffer Wait") - 1, "", 0, wait_begin);
+		spall_auto__end(&spall_buffer, __rdtsc());
+	}
+}
+
+// spall_buffer.length is the committed end, so running into it means either committing more of this chunk or
+// moving on to the next one
+SPALL_NOINSTRUMENT static void spall_auto__grow(void) {
+	SpallAutoChunk *chunk = &spall_chunks[spall_chunk_idx];
+	if (chunk->committed < chunk->length) {
+		uint64_t commit_begin = __rdtsc();
+		spall_auto__commit(chunk);
+		spall_buffer.length = chunk->committed;
+
+		// as long as there's room for it and the event we're here for, otherwise it goes unrecorded
+		if (spall_buffer.head + 2 * SPALL_AUTO_EVENT_MAX <= spall_buffer.length) {
+			spall_auto__begin(&spall_buffer, "Buffer Commit", sizeof("Buffer Commit") - 1, "", 0, commit_begin);
+			spall_auto__end(&spall_buffer, __rdtsc());
+		}
+	}
+	if (spall_buffer.head + SPALL_AUTO_EVENT_MAX > spall_buffer.length) {
+		spall_auto__swap();
+	}
+}
+
+SPALL_FN SPALL_FORCEINLINE void spall_auto__reserve(void) {
+	if (spall_buffer.head + SPALL_AUTO_EVENT_MAX > spall_buffer.length) {
+		spall_auto__grow();
+	}
+}
+
+SPALL_NOINSTRUMENT SPALL_FORCEINLINE void (spall_auto_thread_init)(uint32_t _tid, size_t buffer_size, int64_t symbol_cache_size) {
+	// chunks start on 64KB boundaries so commits stay page-aligned
+	size_t chunk_size = (buffer_size / SPALL_AUTO_BUFFER_COUNT) & ~(size_t)0xFFFF;
+	if (!chunk_size) chunk_size = buffer_size / SPALL_AUTO_BUFFER_COUNT;
+	uint8_t *buffer = spall_auto__mem_reserve(chunk_size * SPALL_AUTO_BUFFER_COUNT);
+	if (!buffer) {
+		return;
+	}
+
+	for (int i = 0; i < SPALL_AUTO_BUFFER_COUNT; i++) {
+		spall_chunks[i] = (SpallAutoChunk){ .data = buffer + i * chunk_size, .length = chunk_size };
+#if SPALL_AUTO_POPULATE
+#if !defined(MAP_POPULATE)
+		spall_auto__mem_commit(spall_chunks[i].data, chunk_size);
+#endif
+		spall_chunks[i].committed = chunk_size;
+#endif
+	}
+
+	// removing initial page-fault bubbles to make the data a little more accurate, without paying for the whole
+	// buffer before the thread has done anything
+	if (!spall_chunks[0].committed) {
+		spall_auto__commit(&spall_chunks[0]);
+	}
+	spall_chunk_idx = 0;
 	tid = _tid;
+	spall_buffer = (SpallBuffer){ .data = spall_chunks[0].data, .length = spall_chunks[0].committed };
+	spall_auto__buffer_init(&spall_buffer);
+
 	ah_init(&addr_map, symbol_cache_size);
 	spall_thread_running = true;
 }
@@ -512,12 +803,40 @@ void (spall_auto_thread_quit)(void) {
 #endif
 	spall_thread_running = false;
 	ah_free(&addr_map);
-	spall_buffer_quit(&spall_ctx, &spall_buffer);
-	free(spall_buffer.data);
+
+	// Hand over what's left, then wait for the writer to be done with all of our buffers before freeing them
+	spall_auto__lock();
+	size_t length = spall_buffer_seal(&spall_ctx, &spall_buffer);
+	if (length) {
+		spall_auto__submit(&spall_chunks[spall_chunk_idx], length);
+	}
+	for (int i = 0; i < SPALL_AUTO_BUFFER_COUNT; i++) {
+		while (spall_chunks[i].busy) {
+			spall_auto__wait(&spall_writer_done);
+		}
+	}
+	spall_auto__unlock();
+	spall_buffer_abort(&spall_buffer);
+	if (spall_chunks[0].data) spall_auto__mem_release(spall_chunks[0].data, spall_chunks[0].length * SPALL_AUTO_BUFFER_COUNT);
 }
 
+#if SPALL_AUTO_V2
+#define spall_auto__init_mmap spall_init_mmap_v2
+#define spall_auto__init_file spall_init_file_v2
+#else
+#define spall_auto__init_mmap spall_init_mmap
+#define spall_auto__init_file spall_init_file
+#endif
+
 void spall_auto_init(char *filename) {
-	spall_ctx = spall_init_file(filename, get_rdtsc_multiplier());
+	double timestamp_unit = get_rdtsc_multiplier();
+#if SPALL_AUTO_MMAP && !_WIN32
+	spall_ctx = spall_auto__init_mmap(filename, timestamp_unit);
+	if (!spall_ctx.write)
+#endif
+	spall_ctx = spall_auto__init_file(filename, timestamp_unit);
+	spall_writer_quit = false;
+	spall_writer_running = spall_auto__writer_start(spall_auto__writer);
 	ah_init(&global_addr_map, 10000);
 	load_self(&global_addr_map);
 #if _WIN32
@@ -526,11 +845,11 @@ void spall_auto_init(char *filename) {
 		process = GetCurrentProcess();
 		char temp_data[512];
 		SpallBuffer temp = { temp_data, sizeof(temp_data) };
-		spall_buffer_init(&spall_ctx, &temp);
-		spall_buffer_begin(&spall_ctx, &temp, "SymInitialize", sizeof("SymInitialize") - 1, (double)__rdtsc());
+		spall_auto__buffer_init(&temp);
+		spall_auto__begin(&temp, "SymInitialize", sizeof("SymInitialize") - 1, "", 0, __rdtsc());
 		SymSetOptions(SYMOPT_DEFERRED_LOADS | SYMOPT_LOAD_LINES | SYMOPT_UNDNAME | SYMOPT_FAIL_CRITICAL_ERRORS | SYMOPT_DEFERRED_LOADS);
 		SymInitialize(process, NULL, TRUE);
-		spall_buffer_end(&spall_ctx, &temp, (double)__rdtsc());
+		spall_auto__end(&temp, __rdtsc());
 		spall_buffer_quit(&spall_ctx, &temp);
 	}
 #if _MSC_VER && !__clang__
@@ -550,27 +869,68 @@ void spall_auto_quit(void) {
 	}
 #endif
 #endif
+	if (spall_writer_running) {
+		spall_auto__lock();
+		spall_writer_quit = true;
+		spall_auto__broadcast(&spall_writer_wake);
+		spall_auto__unlock();
+		spall_auto__writer_join();
+		spall_writer_running = false;
+	}
 	spall_quit(&spall_ctx);
 }
 
 #define not_found "(unknown name)" // only a macro to avoid bogged codegen
-SPALL_NOINSTRUMENT void __cyg_profile_func_enter(void *fn, void *caller) {
-	if (!spall_thread_running) {
-		return;
+
+// The calling thread's entry for fn, looking its name up the first time this thread sees it: the global symbol
+// table first, then the platform resolver. NULL once the thread's symbol cache is full.
+SPALL_FN SymEntry *spall_auto__fn_entry(void *fn) {
+	SymEntry *entry = ah_find(&addr_map, fn);
+	if (entry) {
+		return entry;
 	}
-	spall_thread_running = false;
 
 	Name name;
-	if (
 #if !_WIN32
-		!ah_get(&global_addr_map, fn, &name) && 
+	SymEntry *global = ah_find(&global_addr_map, fn);
+	if (global) {
+		name = global->name;
+	} else
 #endif
-		!ah_get(&addr_map, fn, &name)) {
+	if (!get_addr_name(fn, &name)) {
+		// remembered anyway, so the resolver doesn't get asked again every call
 		name = (Name){.str = not_found, .len = sizeof(not_found) - 1};
 	}
+	return ah_add(&addr_map, fn, name);
+}
 
-	// printf("Begin: \"%s\"\n", name.str);
-	spall_buffer_begin_ex(&spall_ctx, &spall_buffer, name.str, name.len, (double)__rdtsc(), tid, 0);
+// A Begin named after the function at fn. In a v2 stream that's a reference to the entry's id, after defining it
+// if this thread hasn't yet. The timestamp comes after the lookup so the lookup isn't billed to the function.
+SPALL_FN SPALL_FORCEINLINE void spall_auto__begin_fn(SpallBuffer *wb, void *fn, const char *args, int args_len) {
+	SymEntry *entry = spall_auto__fn_entry(fn);
+#if SPALL_AUTO_V2
+	if (entry) {
+		uint32_t id = (uint32_t)(entry - addr_map.entries.arr);
+		if (!entry->interned) {
+			spall_buffer_name_v2(&spall_ctx, wb, id, entry->name.str, entry->name.len);
+			entry->interned = true;
+		}
+		spall_buffer_begin_ref_v2(&spall_ctx, wb, id, args, args_len, __rdtsc());
+		return;
+	}
+#endif
+	Name name = entry ? entry->name : (Name){.str = not_found, .len = sizeof(not_found) - 1};
+	spall_auto__begin(wb, name.str, name.len, args, args_len, __rdtsc());
+}
+
+SPALL_NOINSTRUMENT void __cyg_profile_func_enter(void *fn, void *caller) {
+	if (!spall_thread_running) {
+		return;
+	}
+	spall_thread_running = false;
+	spall_auto__reserve();
+
+	spall_auto__begin_fn(&spall_buffer, fn, "", 0);
 	// spall_buffer_flush(&spall_ctx, &spall_buffer);
 	// spall_flush(&spall_ctx);
 	spall_thread_running = true;
@@ -581,14 +941,57 @@ SPALL_NOINSTRUMENT void __cyg_profile_func_exit(void *fn, void *caller) {
 		return;
 	}
 	spall_thread_running = false;
+	spall_auto__reserve();
 
 	// printf("End\n");
-	spall_buffer_end_ex(&spall_ctx, &spall_buffer, (double)__rdtsc(), tid, 0);
+	spall_auto__end(&spall_buffer, __rdtsc());
 	// spall_buffer_flush(&spall_ctx, &spall_buffer);
 	// spall_flush(&spall_ctx);
 	spall_thread_running = true;
 }
 
+SPALL_NOINSTRUMENT void spall_auto_begin(const char *name, int name_len, const char *args, int args_len) {
+	if (!spall_thread_running) {
+		return;
+	}
+	spall_thread_running = false;
+	spall_auto__reserve();
+	spall_auto__begin(&spall_buffer, name, name_len, args, args_len, __rdtsc());
+	spall_thread_running = true;
+}
+
+SPALL_NOINSTRUMENT void spall_auto_begin_fn(void *fn, const char *args, int args_len) {
+	if (!spall_thread_running) {
+		return;
+	}
+	spall_thread_running = false;
+	spall_auto__reserve();
+	spall_auto__begin_fn(&spall_buffer, fn, args, args_len);
+	spall_thread_running = true;
+}
+
+SPALL_NOINSTRUMENT void spall_auto_end(void) {
+	if (!spall_thread_running) {
+		return;
+	}
+	spall_thread_running = false;
+	spall_auto__reserve();
+	spall_auto__end(&spall_buffer, __rdtsc());
+	spall_thread_running = true;
+}
+
+SPALL_NOINSTRUMENT void spall_auto_mark(const char *name, int name_len, const char *args, int args_len) {
+	if (!spall_thread_running) {
+		return;
+	}
+	spall_thread_running = false;
+	spall_auto__reserve();
+	uint64_t now = __rdtsc();
+	spall_auto__begin(&spall_buffer, name, name_len, args, args_len, now);
+	spall_auto__end(&spall_buffer, now);
+	spall_thread_running = true;
+}
+
 #if _MSC_VER && !__clang__
 
 #define BE(_0,_1,_2,_3,_4,_5,_6,_7,NOTHING) \
@@ -0,0 +1,253 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "spall.h"
+
+/*
+	Turns a version 2 trace (chunks of delta-encoded events, see spall.h) back into version 1 for the viewer.
+
+	spall_convert in.spall out.spall
+*/
+
+// The lead byte and any varint after it. Returns the event kind, or -1 if the chunk ends partway through.
+static int read_lead(const uint8_t *data, size_t end, size_t *at, uint64_t *delta) {
+	if (*at >= end) return -1;
+	uint8_t lead = data[(*at)++];
+	uint64_t value = lead & 31;
+	if (lead & SPALL_V2_DELTA_MORE) {
+		for (int shift = 5;; shift += 7) {
+			if (*at >= end || shift > 63) return -1;
+			uint8_t byte = data[(*at)++];
+			value |= (uint64_t)(byte & 0x7F) << shift;
+			if (!(byte & 0x80)) break;
+		}
+	}
+	*delta = value;
+	return lead & SPALL_V2_KIND_MASK;
+}
+
+// A plain varint, like the ids after a Name or BeginRef lead byte
+static int read_varint(const uint8_t *data, size_t end, size_t *at, uint64_t *value) {
+	uint64_t result = 0;
+	for (int shift = 0;; shift += 7) {
+		if (*at >= end || shift > 63) return 0;
+		uint8_t byte = data[(*at)++];
+		result |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) break;
+	}
+	*value = result;
+	return 1;
+}
+
+// Interned names, which belong to a pid + tid and carry over from one of its chunks to the next
+typedef struct {
+	uint8_t len;
+	char str[255];
+	int defined;
+} Interned;
+
+typedef struct {
+	uint32_t pid, tid;
+	Interned *names;
+	uint32_t names_cap;
+} Stream;
+
+typedef struct {
+	Stream *arr;
+	size_t len, cap;
+} Streams;
+
+#define MAX_NAME_ID (1u << 24) // a sanity limit, so a garbage id can't ask for gigabytes
+
+static Stream *find_stream(Streams *streams, uint32_t pid, uint32_t tid) {
+	for (size_t i = 0; i < streams->len; i++) {
+		if (streams->arr[i].pid == pid && streams->arr[i].tid == tid) return &streams->arr[i];
+	}
+	if (streams->len == streams->cap) {
+		size_t cap = streams->cap ? streams->cap * 2 : 16;
+		Stream *arr = realloc(streams->arr, cap * sizeof(*arr));
+		if (!arr) return NULL;
+		streams->arr = arr;
+		streams->cap = cap;
+	}
+	Stream *stream = &streams->arr[streams->len++];
+	*stream = (Stream){ .pid = pid, .tid = tid };
+	return stream;
+}
+
+static int define_name(Stream *stream, uint64_t id, const char *name, uint8_t name_len) {
+	if (id >= MAX_NAME_ID) return 0;
+	if (id >= stream->names_cap) {
+		uint32_t cap = stream->names_cap ? stream->names_cap : 256;
+		while (cap <= id) cap *= 2;
+		Interned *names = realloc(stream->names, cap * sizeof(*names));
+		if (!names) return 0;
+		memset(names + stream->names_cap, 0, (cap - stream->names_cap) * sizeof(*names));
+		stream->names = names;
+		stream->names_cap = cap;
+	}
+	Interned *entry = &stream->names[id];
+	memcpy(entry->str, name, name_len);
+	entry->len = name_len;
+	entry->defined = 1;
+	return 1;
+}
+
+static uint8_t *read_file(const char *path, size_t *size) {
+	FILE *f = fopen(path, "rb");
+	if (!f) return NULL;
+	fseek(f, 0, SEEK_END);
+	long length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *data = length > 0 ? malloc((size_t)length) : NULL;
+	if (data && fread(data, (size_t)length, 1, f) != 1) {
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	*size = (size_t)length;
+	return data;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: spall_convert in.spall out.spall\n");
+		return 1;
+	}
+
+	size_t size = 0;
+	uint8_t *data = read_file(argv[1], &size);
+	if (!data || size < sizeof(SpallHeader)) {
+		fprintf(stderr, "couldn't read a trace from %s\n", argv[1]);
+		return 1;
+	}
+	SpallHeader header;
+	memcpy(&header, data, sizeof(header));
+	if (header.magic_header != 0x0BADF00D) {
+		fprintf(stderr, "%s isn't a binary spall trace\n", argv[1]);
+		return 1;
+	}
+	if (header.version != 2) {
+		fprintf(stderr, "%s is version %llu, nothing to convert\n", argv[1], (unsigned long long)header.version);
+		return 1;
+	}
+
+	SpallProfile out = spall_init_file(argv[2], header.timestamp_unit);
+	if (!out.write) {
+		fprintf(stderr, "couldn't open %s\n", argv[2]);
+		return 1;
+	}
+	SpallBuffer buffer = { malloc(1 << 20), 1 << 20 };
+	spall_buffer_init(&out, &buffer);
+
+	Streams streams = {0};
+	uint64_t chunks = 0, events = 0;
+	int result = 0;
+	size_t at = sizeof(SpallHeader);
+	while (at < size && !result) {
+		SpallChunkHeader chunk;
+		if (size - at < sizeof(chunk) || data[at] != SpallEventType_Chunk) {
+			fprintf(stderr, "expected a chunk at byte %zu\n", at);
+			result = 1;
+			break;
+		}
+		memcpy(&chunk, data + at, sizeof(chunk));
+		at += sizeof(chunk);
+		size_t end = at + chunk.length;
+		if (end > size) {
+			fprintf(stderr, "the last chunk is cut off, converting what's there\n");
+			end = size;
+		}
+
+		Stream *stream = find_stream(&streams, chunk.pid, chunk.tid);
+		if (!stream) {
+			fprintf(stderr, "out of memory\n");
+			result = 1;
+			break;
+		}
+
+		uint64_t when = chunk.base;
+		while (at < end) {
+			uint64_t delta;
+			int kind = read_lead(data, end, &at, &delta);
+			if (kind < 0) {
+				fprintf(stderr, "event cut off at byte %zu\n", at);
+				result = 1;
+				break;
+			}
+			when += delta;
+
+			if (kind == SpallV2_End) {
+				spall_buffer_end_ex(&out, &buffer, (double)when, chunk.tid, chunk.pid);
+			} else if (kind == SpallV2_Begin) {
+				if (end - at < 2 || end - at - 2 < (size_t)data[at] + data[at + 1]) {
+					fprintf(stderr, "event cut off at byte %zu\n", at);
+					result = 1;
+					break;
+				}
+				uint8_t name_len = data[at];
+				uint8_t args_len = data[at + 1];
+				const char *name = (const char *)data + at + 2;
+				spall_buffer_begin_args(&out, &buffer, name, name_len, name + name_len, args_len, (double)when, chunk.tid, chunk.pid);
+				at += 2 + name_len + args_len;
+			} else if (kind == SpallV2_BeginRef) {
+				uint64_t id;
+				if (!read_varint(data, end, &at, &id) || at >= end || end - at - 1 < data[at]) {
+					fprintf(stderr, "event cut off at byte %zu\n", at);
+					result = 1;
+					break;
+				}
+				if (id >= stream->names_cap || !stream->names[id].defined) {
+					fprintf(stderr, "name id %llu at byte %zu was never defined\n", (unsigned long long)id, at);
+					result = 1;
+					break;
+				}
+				uint8_t args_len = data[at];
+				const char *args = (const char *)data + at + 1;
+				Interned *name = &stream->names[id];
+				spall_buffer_begin_args(&out, &buffer, name->str, name->len, args, args_len, (double)when, chunk.tid, chunk.pid);
+				at += 1 + args_len;
+			} else if (kind == SpallV2_Name) {
+				uint64_t id;
+				if (!read_varint(data, end, &at, &id) || at >= end || end - at - 1 < data[at]) {
+					fprintf(stderr, "event cut off at byte %zu\n", at);
+					result = 1;
+					break;
+				}
+				uint8_t name_len = data[at];
+				if (!define_name(stream, id, (const char *)data + at + 1, name_len)) {
+					fprintf(stderr, "can't define name id %llu at byte %zu\n", (unsigned long long)id, at);
+					result = 1;
+					break;
+				}
+				at += 1 + name_len;
+				continue; // not an event of its own
+			} else {
+				fprintf(stderr, "unknown event kind %d at byte %zu\n", kind >> 6, at);
+				result = 1;
+				break;
+			}
+			events++;
+		}
+		at = end;
+		chunks++;
+	}
+
+	spall_buffer_quit(&out, &buffer);
+	spall_quit(&out);
+	free(buffer.data);
+	for (size_t i = 0; i < streams.len; i++) free(streams.arr[i].names);
+	free(streams.arr);
+
+	size_t out_size = 0;
+	free(read_file(argv[2], &out_size));
+	printf("%llu chunks, %llu events: %zu bytes -> %zu bytes\n",
+	       (unsigned long long)chunks, (unsigned long long)events, size, out_size);
+
+	free(data);
+	return result;
+}
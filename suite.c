@@ -0,0 +1,592 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TPOOL_IMPLEMENTATION
+#include "tpool.h"
+
+/*
+	Benchmark suite
+
+	The standard workloads for judging a change to the pool: fork-join recursion (fib, nqueens), empty task spawn
+	throughput, parallel-for over a big array, an unbalanced tree search, and a producer-consumer pipeline fed from
+	outside the pool. Each one runs serially first, for the baseline and the answer, then on one pool resized to
+	1, 2, 4... threads up to the max. Every run gets checked against the serial answer.
+
+	Reported per run: tasks/sec and speedup over serial, both off the median repetition, and the p50/p99/max of the
+	repetition times. The pipeline reports the time each item took from submit to done instead, which is the
+	latency that matters there. p99 is left blank under 100 samples (100 reps, for anything but the pipeline),
+	where it would just be the max again. With csv, one line per run and nothing else, for diffing builds and plotting.
+
+	suite [workload|all] [max_threads] [reps] [csv]
+*/
+
+typedef struct SuiteResult {
+	uint64_t check; // has to come out the same as the serial run
+	uint64_t tasks; // tasks it ran, or would have as a pool workload
+} SuiteResult;
+
+// pool is NULL for the serial run
+typedef SuiteResult suite_proc(TPool *pool);
+
+static int suite_max_threads;
+
+// Per-thread counters, so counting doesn't turn into a benchmark of one cache line
+typedef struct SuiteCounter {
+	TPOOL_ALIGN(TPOOL_CACHE_LINE) uint64_t value;
+} SuiteCounter;
+
+static SuiteCounter *suite_counters;
+static void *suite_counters_block; // what suite_counters was carved out of, to line it up with the cache
+
+static void suite_count(uint64_t n) {
+	suite_counters[current_thread->idx].value += n;
+}
+
+static uint64_t suite_count_reset(void) {
+	uint64_t total = 0;
+	for (int i = 0; i < suite_max_threads; i++) {
+		total += suite_counters[i].value;
+		suite_counters[i].value = 0;
+	}
+	return total;
+}
+
+static uint64_t suite_mix(uint64_t x) {
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+/*
+	fib
+
+	Two children per call and no cutoff, so it's all spawn and join overhead.
+*/
+
+#define FIB_N 25
+
+typedef struct FibTask {
+	int n;
+	uint64_t result;
+	uint64_t calls;
+} FibTask;
+
+static void fib_serial(FibTask *task) {
+	task->calls = 1;
+	if (task->n < 2) {
+		task->result = (uint64_t)task->n;
+		return;
+	}
+	FibTask children[2] = { { .n = task->n - 1 }, { .n = task->n - 2 } };
+	fib_serial(&children[0]);
+	fib_serial(&children[1]);
+	task->result = children[0].result + children[1].result;
+	task->calls += children[0].calls + children[1].calls;
+}
+
+static ssize_t fib_task(void *args) {
+	FibTask *task = args;
+	task->calls = 1;
+	if (task->n < 2) {
+		task->result = (uint64_t)task->n;
+		return 0;
+	}
+
+	TPool *pool = current_thread->pool;
+	FibTask children[2] = { { .n = task->n - 1 }, { .n = task->n - 2 } };
+	TPoolGroup group;
+	tpool_group_init(&group);
+	tpool_group_push(pool, &group, (TPoolTask){ .do_work = fib_task, .args = &children[0] });
+	fib_task(&children[1]);
+	tpool_group_wait(pool, &group);
+	task->result = children[0].result + children[1].result;
+	task->calls += children[0].calls + children[1].calls;
+	return 0;
+}
+
+static SuiteResult fib_run(TPool *pool) {
+	FibTask root = { .n = FIB_N };
+	if (pool) {
+		fib_task(&root);
+	} else {
+		fib_serial(&root);
+	}
+	return (SuiteResult){ root.result, root.calls };
+}
+
+/*
+	nqueens
+
+	Every safe square on the next row is a child. Fan-out up to n, and the tree's lopsided.
+*/
+
+#define NQUEENS_N 10
+
+typedef struct QueensTask {
+	int row;
+	uint64_t cols, diag1, diag2;
+	uint64_t solutions;
+	uint64_t nodes;
+} QueensTask;
+
+static QueensTask queens_child(QueensTask *task, int col) {
+	QueensTask child = { .row = task->row + 1 };
+	child.cols  = task->cols  | (1ull << col);
+	child.diag1 = task->diag1 | (1ull << (task->row + col));
+	child.diag2 = task->diag2 | (1ull << (task->row - col + NQUEENS_N));
+	return child;
+}
+
+static bool queens_safe(QueensTask *task, int col) {
+	return !(task->cols & (1ull << col)) && !(task->diag1 & (1ull << (task->row + col))) &&
+	       !(task->diag2 & (1ull << (task->row - col + NQUEENS_N)));
+}
+
+static void queens_serial(QueensTask *task) {
+	task->nodes = 1;
+	if (task->row == NQUEENS_N) {
+		task->solutions = 1;
+		return;
+	}
+	for (int col = 0; col < NQUEENS_N; col++) {
+		if (queens_safe(task, col)) {
+			QueensTask child = queens_child(task, col);
+			queens_serial(&child);
+			task->solutions += child.solutions;
+			task->nodes += child.nodes;
+		}
+	}
+}
+
+static ssize_t queens_task(void *args) {
+	QueensTask *task = args;
+	task->nodes = 1;
+	if (task->row == NQUEENS_N) {
+		task->solutions = 1;
+		return 0;
+	}
+
+	TPool *pool = current_thread->pool;
+	QueensTask children[NQUEENS_N];
+	int count = 0;
+	TPoolGroup group;
+	tpool_group_init(&group);
+	for (int col = 0; col < NQUEENS_N; col++) {
+		if (queens_safe(task, col)) {
+			children[count] = queens_child(task, col);
+			tpool_group_push(pool, &group, (TPoolTask){ .do_work = queens_task, .args = &children[count] });
+			count++;
+		}
+	}
+	tpool_group_wait(pool, &group);
+	for (int i = 0; i < count; i++) {
+		task->solutions += children[i].solutions;
+		task->nodes += children[i].nodes;
+	}
+	return 0;
+}
+
+static SuiteResult queens_run(TPool *pool) {
+	QueensTask root = {0};
+	if (pool) {
+		queens_task(&root);
+	} else {
+		queens_serial(&root);
+	}
+	return (SuiteResult){ root.solutions, root.nodes };
+}
+
+/*
+	spawn
+
+	Empty tasks pushed from one thread in batches, what's left is the cost of getting a task from one thread to
+	another and run.
+*/
+
+#define SPAWN_TASKS (1 << 20)
+#define SPAWN_BATCH 256
+
+static ssize_t spawn_task(void *args) {
+	(void)args;
+	suite_count(1);
+	return 0;
+}
+
+// Called through this so the serial loop makes every call, the same indirect one the pool does, instead of being
+// folded into a single add
+static tpool_task_proc *volatile spawn_task_proc = spawn_task;
+
+static SuiteResult spawn_run(TPool *pool) {
+	if (!pool) {
+		for (int i = 0; i < SPAWN_TASKS; i++) {
+			spawn_task_proc(NULL);
+		}
+	} else {
+		TPoolTask tasks[SPAWN_BATCH];
+		for (int i = 0; i < SPAWN_BATCH; i++) {
+			tasks[i] = (TPoolTask){ .do_work = spawn_task };
+		}
+		for (int i = 0; i < SPAWN_TASKS; i += SPAWN_BATCH) {
+			tpool_push_batch(pool, tasks, SPAWN_BATCH);
+		}
+		tpool_wait(pool);
+	}
+	uint64_t ran = suite_count_reset();
+	return (SuiteResult){ ran, SPAWN_TASKS };
+}
+
+/*
+	pfor
+
+	One pass from an array too big for cache into another, summing as it goes. Memory bound, so it tops out
+	wherever the bandwidth does.
+*/
+
+#define PFOR_COUNT (1 << 23)
+#define PFOR_GRAIN (1 << 14)
+
+static uint64_t *pfor_in;
+static uint64_t *pfor_out;
+
+static void pfor_reduce(void *ctx, int64_t begin, int64_t end, void *acc) {
+	(void)ctx;
+	uint64_t sum = 0;
+	for (int64_t i = begin; i < end; i++) {
+		pfor_out[i] = pfor_in[i] * 6364136223846793005ull + (uint64_t)i;
+		sum += pfor_out[i] >> 32;
+	}
+	*(uint64_t *)acc += sum;
+}
+
+static void pfor_join(void *ctx, void *acc, const void *other) {
+	(void)ctx;
+	*(uint64_t *)acc += *(const uint64_t *)other;
+}
+
+static SuiteResult pfor_run(TPool *pool) {
+	uint64_t sum = 0;
+	if (pool) {
+		tpool_parallel_reduce(pool, 0, PFOR_COUNT, PFOR_GRAIN, pfor_reduce, pfor_join, NULL, &sum, sizeof(sum));
+	} else {
+		pfor_reduce(NULL, 0, PFOR_COUNT, &sum);
+	}
+	return (SuiteResult){ sum, PFOR_COUNT / PFOR_GRAIN };
+}
+
+/*
+	uts
+
+	Unbalanced tree search, the binomial kind: the root has UTS_ROOT children, and every other node has UTS_M
+	children with probability UTS_Q, or none. qm is just under 1, so subtrees range from nothing to very deep, and
+	nobody can tell in advance which. Each node's a fire-and-forget task, the shape is all in a hash of its parent.
+*/
+
+#define UTS_ROOT 1000
+#define UTS_M 8
+#define UTS_Q 0.1245
+
+static int uts_children(uint64_t state) {
+	return (double)(suite_mix(state) >> 11) * (1.0 / 9007199254740992.0) < UTS_Q ? UTS_M : 0;
+}
+
+static uint64_t uts_child(uint64_t state, int i) {
+	return suite_mix(state ^ (0xD6E8FEB86659FD93ull * (uint64_t)(i + 1)));
+}
+
+static ssize_t uts_task(void *args) {
+	uint64_t state = (uint64_t)(uintptr_t)args;
+	int count = uts_children(state);
+	suite_count(1);
+	if (count) {
+		TPoolTask children[UTS_M];
+		for (int i = 0; i < count; i++) {
+			children[i] = (TPoolTask){ .do_work = uts_task, .args = (void *)(uintptr_t)uts_child(state, i) };
+		}
+		tpool_push_batch(current_thread->pool, children, (size_t)count);
+	}
+	return 0;
+}
+
+static SuiteResult uts_run(TPool *pool) {
+	uint64_t root = 42;
+	if (pool) {
+		for (int i = 0; i < UTS_ROOT; i++) {
+			tpool_push(pool, (TPoolTask){ .do_work = uts_task, .args = (void *)(uintptr_t)uts_child(root, i) });
+		}
+		tpool_wait(pool);
+	} else {
+		// deep enough that it's not going on the call stack
+		size_t capacity = 1024;
+		size_t top = 0;
+		uint64_t *stack = malloc(sizeof(uint64_t) * capacity);
+		for (int i = 0; i < UTS_ROOT; i++) {
+			stack[top++] = uts_child(root, i);
+		}
+		while (top) {
+			uint64_t state = stack[--top];
+			int count = uts_children(state);
+			suite_count(1);
+			if (top + (size_t)count > capacity) {
+				capacity *= 2;
+				stack = realloc(stack, sizeof(uint64_t) * capacity);
+			}
+			for (int i = 0; i < count; i++) {
+				stack[top++] = uts_child(state, i);
+			}
+		}
+		free(stack);
+	}
+	uint64_t nodes = suite_count_reset();
+	return (SuiteResult){ nodes, nodes };
+}
+
+/*
+	pipeline
+
+	A producer thread outside the pool submits items, at most PIPELINE_WINDOW in flight, and each goes through
+	PIPELINE_STAGES stages of a little work, each stage a task that pushes the next. What we time is each item,
+	from submit to the last stage finishing.
+*/
+
+#define PIPELINE_ITEMS 20000
+#define PIPELINE_STAGES 4
+#define PIPELINE_WINDOW 256
+#define PIPELINE_WORK 500
+
+typedef struct PipelineItem {
+	uint64_t value;
+	int stage;
+	uint64_t submitted_ns;
+} PipelineItem;
+
+typedef struct Pipeline {
+	TPool *pool;
+	PipelineItem *items;
+	TPoolGroup group;
+	_Atomic int64_t in_flight;
+	_Atomic uint64_t check;
+} Pipeline;
+
+static Pipeline pipeline;
+static uint64_t *pipeline_latency;
+
+static void pipeline_stage(PipelineItem *item) {
+	uint64_t x = item->value;
+	for (int i = 0; i < PIPELINE_WORK; i++) {
+		x = suite_mix(x);
+	}
+	item->value = x;
+	item->stage++;
+}
+
+static ssize_t pipeline_task(void *args) {
+	PipelineItem *item = args;
+	pipeline_stage(item);
+	if (item->stage < PIPELINE_STAGES) {
+		tpool_push(pipeline.pool, (TPoolTask){ .do_work = pipeline_task, .args = item });
+		return 0;
+	}
+
+	pipeline_latency[item - pipeline.items] = tpool_now_ns() - item->submitted_ns;
+	atomic_fetch_add_explicit(&pipeline.check, item->value, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pipeline.in_flight, -1, memory_order_release);
+	tpool_group_finish(pipeline.pool, &pipeline.group);
+	return 0;
+}
+
+static void *pipeline_producer(void *ptr) {
+	(void)ptr;
+	for (int i = 0; i < PIPELINE_ITEMS; i++) {
+		while (atomic_load_explicit(&pipeline.in_flight, memory_order_acquire) >= PIPELINE_WINDOW) {
+			sched_yield();
+		}
+		atomic_fetch_add_explicit(&pipeline.in_flight, 1, memory_order_relaxed);
+
+		PipelineItem *item = &pipeline.items[i];
+		*item = (PipelineItem){ (uint64_t)i, 0, tpool_now_ns() };
+		tpool_group_add(&pipeline.group, 1);
+		tpool_submit(pipeline.pool, (TPoolTask){ .do_work = pipeline_task, .args = item });
+	}
+
+	// the hold the producer started out with
+	tpool_group_finish(pipeline.pool, &pipeline.group);
+	return NULL;
+}
+
+static SuiteResult pipeline_run(TPool *pool) {
+	pipeline.pool = pool;
+	atomic_store_explicit(&pipeline.check, 0, memory_order_relaxed);
+	if (!pool) {
+		for (int i = 0; i < PIPELINE_ITEMS; i++) {
+			PipelineItem *item = &pipeline.items[i];
+			*item = (PipelineItem){ (uint64_t)i, 0, tpool_now_ns() };
+			while (item->stage < PIPELINE_STAGES) {
+				pipeline_stage(item);
+			}
+			pipeline_latency[i] = tpool_now_ns() - item->submitted_ns;
+			atomic_fetch_add_explicit(&pipeline.check, item->value, memory_order_relaxed);
+		}
+	} else {
+		atomic_store_explicit(&pipeline.in_flight, 0, memory_order_relaxed);
+		tpool_group_init(&pipeline.group);
+		tpool_group_add(&pipeline.group, 1);
+
+		pthread_t producer;
+		pthread_create(&producer, NULL, pipeline_producer, NULL);
+		tpool_group_wait(pool, &pipeline.group);
+		pthread_join(producer, NULL);
+	}
+	return (SuiteResult){ atomic_load_explicit(&pipeline.check, memory_order_relaxed), PIPELINE_ITEMS * PIPELINE_STAGES };
+}
+
+/*
+	Runner
+*/
+
+typedef struct SuiteWorkload {
+	const char *name;
+	suite_proc *run;
+	// latencies are per item, out of pipeline_latency, not per repetition
+	bool per_item;
+} SuiteWorkload;
+
+static SuiteWorkload suite_workloads[] = {
+	{ "fib",      fib_run,      false },
+	{ "nqueens",  queens_run,   false },
+	{ "spawn",    spawn_run,    false },
+	{ "pfor",     pfor_run,     false },
+	{ "uts",      uts_run,      false },
+	{ "pipeline", pipeline_run, true },
+};
+
+static bool suite_csv;
+
+static int suite_cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Runs one workload reps times, after a warmup, and prints the row. Returns the median time.
+static uint64_t suite_measure(SuiteWorkload *workload, TPool *pool, int reps, uint64_t expect, uint64_t serial_ns) {
+	uint64_t *rep_ns = calloc(sizeof(uint64_t), (size_t)reps);
+	size_t sample_count = workload->per_item ? (size_t)reps * PIPELINE_ITEMS : (size_t)reps;
+	uint64_t *samples = workload->per_item ? calloc(sizeof(uint64_t), sample_count) : rep_ns;
+
+	SuiteResult result = workload->run(pool);
+	bool ok = result.check == expect || !serial_ns;
+	for (int r = 0; r < reps; r++) {
+		uint64_t start = tpool_now_ns();
+		SuiteResult rep = workload->run(pool);
+		rep_ns[r] = tpool_now_ns() - start;
+		ok = ok && (rep.check == expect || !serial_ns);
+		if (workload->per_item) {
+			memcpy(samples + (size_t)r * PIPELINE_ITEMS, pipeline_latency, sizeof(uint64_t) * PIPELINE_ITEMS);
+		}
+	}
+
+	// the median rep's time, before sorting the samples (which might be the same array)
+	uint64_t *sorted = calloc(sizeof(uint64_t), (size_t)reps);
+	memcpy(sorted, rep_ns, sizeof(uint64_t) * (size_t)reps);
+	qsort(sorted, (size_t)reps, sizeof(uint64_t), suite_cmp_u64);
+	uint64_t median_ns = sorted[reps / 2] ? sorted[reps / 2] : 1;
+	free(sorted);
+	qsort(samples, sample_count, sizeof(uint64_t), suite_cmp_u64);
+
+	int threads = pool ? tpool_thread_count(pool) : 0;
+	double tasks_per_sec = (double)result.tasks / ((double)median_ns / 1000000000.0);
+	double speedup = serial_ns ? (double)serial_ns / (double)median_ns : 1.0;
+	double p50 = (double)samples[sample_count / 2] / 1000.0;
+	double max = (double)samples[sample_count - 1] / 1000.0;
+
+	// nearest rank, and under 100 samples that's just the max, so it's left blank
+	char p99[32];
+	snprintf(p99, sizeof(p99), "%s", suite_csv ? "" : "-");
+	if (sample_count >= 100) {
+		snprintf(p99, sizeof(p99), "%.1f", (double)samples[(sample_count * 99 + 99) / 100 - 1] / 1000.0);
+	}
+
+	if (suite_csv) {
+		printf("%s,%d,%d,%" PRIu64 ",%.3f,%.0f,%.3f,%.1f,%s,%.1f,%s\n", workload->name, threads, reps, result.tasks,
+		       (double)median_ns / 1000000.0, tasks_per_sec, speedup, p50, p99, max, ok ? "ok" : "wrong");
+	} else {
+		char name[16];
+		snprintf(name, sizeof(name), pool ? "%d" : "serial", threads);
+		printf("%-10s %-8s %12" PRIu64 " %10.2f %14.0f %8.2f %10.1f %10s %10.1f%s\n", workload->name, name,
+		       result.tasks, (double)median_ns / 1000000.0, tasks_per_sec, speedup, p50, p99, max,
+		       ok ? "" : "   WRONG");
+	}
+	fflush(stdout);
+
+	if (samples != rep_ns) {
+		free(samples);
+	}
+	free(rep_ns);
+	return median_ns;
+}
+
+int main(int argc, char **argv) {
+	const char *only = argc > 1 ? argv[1] : "all";
+	suite_max_threads = argc > 2 ? atoi(argv[2]) : 8;
+	int reps = argc > 3 ? atoi(argv[3]) : 10;
+	suite_csv = argc > 4 && !strcmp(argv[4], "csv");
+	if (suite_max_threads < 1) suite_max_threads = 1;
+	if (reps < 1) reps = 1;
+
+	suite_counters_block = calloc(sizeof(SuiteCounter), (size_t)suite_max_threads + 1);
+	suite_counters = (SuiteCounter *)(((uintptr_t)suite_counters_block + TPOOL_CACHE_LINE - 1) & ~(uintptr_t)(TPOOL_CACHE_LINE - 1));
+	pfor_in = malloc(sizeof(uint64_t) * PFOR_COUNT);
+	pfor_out = malloc(sizeof(uint64_t) * PFOR_COUNT);
+	for (int64_t i = 0; i < PFOR_COUNT; i++) {
+		pfor_in[i] = suite_mix((uint64_t)i);
+	}
+	pipeline.items = calloc(sizeof(PipelineItem), PIPELINE_ITEMS);
+	pipeline_latency = calloc(sizeof(uint64_t), PIPELINE_ITEMS);
+
+	// one pool for everything, resized for each thread count
+	TPoolOptions opts = {0};
+	opts.max_thread_count = suite_max_threads;
+	TPool *pool = tpool_init_opts(&opts);
+
+	if (suite_csv) {
+		printf("workload,threads,reps,tasks,ms,tasks_per_sec,speedup,p50_us,p99_us,max_us,check\n");
+	} else {
+		printf("suite: up to %d threads, %d reps each, median rep for ms, tasks/sec and speedup\n", suite_max_threads, reps);
+		printf("latency is per rep, per item for the pipeline\n");
+		printf("%-10s %-8s %12s %10s %14s %8s %10s %10s %10s\n", "workload", "threads", "tasks", "ms", "tasks/sec",
+		       "speedup", "p50_us", "p99_us", "max_us");
+	}
+
+	for (size_t w = 0; w < sizeof(suite_workloads) / sizeof(suite_workloads[0]); w++) {
+		SuiteWorkload *workload = &suite_workloads[w];
+		if (strcmp(only, "all") && strcmp(only, workload->name)) {
+			continue;
+		}
+
+		// serial runs on the main thread, which counts as thread 0
+		uint64_t expect = workload->run(NULL).check;
+		uint64_t serial_ns = suite_measure(workload, NULL, reps, expect, 0);
+		for (int threads = 1;; threads *= 2) {
+			if (threads > suite_max_threads) {
+				threads = suite_max_threads;
+			}
+			tpool_set_thread_count(pool, threads);
+			suite_measure(workload, pool, reps, expect, serial_ns);
+			if (threads == suite_max_threads) {
+				break;
+			}
+		}
+	}
+
+	tpool_destroy(pool);
+	free(pipeline_latency);
+	free(pipeline.items);
+	free(pfor_out);
+	free(pfor_in);
+	free(suite_counters_block);
+	return 0;
+}
@@ -0,0 +1,3128 @@
+#ifndef TPOOL_H
+#define TPOOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#if !_WIN32
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#endif
+
+#define TPOOL_ALIGN(n) _Alignas(n)
+
+#else
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+
+typedef SSIZE_T ssize_t;
+typedef HANDLE pthread_t;
+typedef CRITICAL_SECTION pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+#define pthread_create(thread, _, routine, userdata) (*(thread) = CreateThread(NULL, 0, (DWORD (*)(void *))routine, userdata, 0, NULL))
+#define pthread_join(thread, _) WaitForSingleObject(thread, INFINITE)
+#define pthread_mutex_init(m, _) InitializeCriticalSection(m)
+#define pthread_mutex_lock(m) EnterCriticalSection(m)
+#define pthread_mutex_trylock(m) TryEnterCriticalSection(m)
+#define pthread_mutex_unlock(m) LeaveCriticalSection(m)
+#define pthread_cond_init(c, _) InitializeConditionVariable(c)
+#define pthread_cond_broadcast(c) WakeAllConditionVariable(c)
+#define pthread_cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define pthread_cond_signal(c) WakeConditionVariable(c)
+#define sched_yield() SwitchToThread()
+
+#define _Atomic volatile
+#define _Thread_local __declspec(thread)
+
+#pragma comment(lib, "Synchronization")
+
+// Only what the pool needs, and only for 32 and 64-bit operands (x64 volatile loads/stores are acquire/release)
+#define memory_order_relaxed 0
+#define memory_order_acquire 0
+#define memory_order_release 0
+#define memory_order_acq_rel 0
+#define memory_order_seq_cst 0
+#define atomic_load_explicit(p, o) (*(p))
+#define atomic_store_explicit(p, v, o) (*(p) = (v))
+#define atomic_fetch_add_explicit(p, v, o) (sizeof(*(p)) == 8 ? InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v)) : InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v)))
+#define atomic_compare_exchange_strong_explicit(p, e, d, s, f) tpool__cas64((volatile LONG64 *)(p), (LONG64 *)(e), (LONG64)(d))
+#define atomic_compare_exchange_weak_explicit(p, e, d, s, f) tpool__cas64((volatile LONG64 *)(p), (LONG64 *)(e), (LONG64)(d))
+#define atomic_exchange_explicit(p, v, o) InterlockedExchangePointer((PVOID volatile *)(p), (PVOID)(v)) // pointers only
+#define atomic_thread_fence(o) MemoryBarrier()
+
+#define TPOOL_ALIGN(n) __declspec(align(n))
+
+static inline bool tpool__cas64(volatile LONG64 *p, LONG64 *expected, LONG64 desired) {
+	LONG64 prev = InterlockedCompareExchange64(p, desired, *expected);
+	if (prev == *expected) {
+		return true;
+	}
+	*expected = prev;
+	return false;
+}
+
+static inline void usleep(__int64 usec) {
+	__int64 ft = -10 * usec;
+
+	HANDLE timer = CreateWaitableTimer(NULL, TRUE, NULL);
+	SetWaitableTimer(timer, (LARGE_INTEGER *)&ft, 0, NULL, NULL, 0);
+	WaitForSingleObject(timer, INFINITE);
+	CloseHandle(timer);
+}
+
+#endif
+
+// Called on every worker as it starts up and just before it exits, define these before including to hook in a profiler
+#ifndef TPOOL_THREAD_INIT
+#define TPOOL_THREAD_INIT(idx)
+#endif
+#ifndef TPOOL_THREAD_QUIT
+#define TPOOL_THREAD_QUIT()
+#endif
+
+// Scheduling events, define any of these before including to send them to a tracer. They need no function
+// instrumentation, main.c turns them into spall events with spall_auto.h. All on the thread they happen on.
+//   TASK_BEGIN/END    around every task, proc is its do_work
+//   STEAL             this thread (thief) just took count tasks from victim, both thread indices
+//   PARK_BEGIN/END    around a worker sleeping, not counting the spin before it
+//   QUEUE_DEPTH       tasks waiting in this thread's queues, sampled every TPOOL_TRACE_DEPTH_INTERVAL picks
+#ifndef TPOOL_TRACE_TASK_BEGIN
+#define TPOOL_TRACE_TASK_BEGIN(proc)
+#endif
+#ifndef TPOOL_TRACE_TASK_END
+#define TPOOL_TRACE_TASK_END()
+#endif
+#ifndef TPOOL_TRACE_STEAL
+#define TPOOL_TRACE_STEAL(victim, thief, count)
+#endif
+#ifndef TPOOL_TRACE_PARK_BEGIN
+#define TPOOL_TRACE_PARK_BEGIN()
+#endif
+#ifndef TPOOL_TRACE_PARK_END
+#define TPOOL_TRACE_PARK_END()
+#endif
+#ifndef TPOOL_TRACE_QUEUE_DEPTH
+#define TPOOL_TRACE_QUEUE_DEPTH(depth)
+#endif
+#ifndef TPOOL_TRACE_DEPTH_INTERVAL
+#define TPOOL_TRACE_DEPTH_INTERVAL 64
+#endif
+
+#define TPOOL_CACHE_LINE 64
+
+// How many times an idle worker re-checks for work before it goes to sleep. Can be changed per pool at any time.
+#ifndef TPOOL_SPIN_COUNT
+#define TPOOL_SPIN_COUNT 1000
+#endif
+
+#if _WIN32
+#define tpool__pause() YieldProcessor()
+#elif defined(__x86_64__) || defined(__i386__)
+#define tpool__pause() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define tpool__pause() __asm__ __volatile__("yield")
+#else
+#define tpool__pause() ((void)0)
+#endif
+
+// Queues start at THREAD_QUEUE_CAP tasks and double whenever they fill up, until THREAD_QUEUE_MAX_CAP.
+// Past that, tpool_try_push fails and tpool_push runs the task inline. Both must be powers of two.
+#ifndef THREAD_QUEUE_CAP
+#define THREAD_QUEUE_CAP 16384
+#endif
+#ifndef THREAD_QUEUE_MAX_CAP
+#define THREAD_QUEUE_MAX_CAP (1 << 22)
+#endif
+
+// Most tasks a thief will take in one go when the pool steals half
+#ifndef TPOOL_STEAL_HALF_MAX
+#define TPOOL_STEAL_HALF_MAX 32
+#endif
+
+// Slots in the pool's injection queue, for threads outside the pool to submit to. Must be a power of two.
+#ifndef TPOOL_INJECT_CAP
+#define TPOOL_INJECT_CAP 4096
+#endif
+// Most tasks a worker takes off the injection queue at once, the rest go on its own queue for others to steal
+#ifndef TPOOL_INJECT_BATCH
+#define TPOOL_INJECT_BATCH 16
+#endif
+
+// Every this many tasks, a thread looks at its lowest priority lane first, so it keeps moving under a steady
+// stream of more important work
+#ifndef TPOOL_STARVATION_INTERVAL
+#define TPOOL_STARVATION_INTERVAL 64
+#endif
+
+// Per-thread statistics, see tpool_stats. Set to 0 to compile the bookkeeping out of the hot paths, and tpool_stats
+// reads zeros for everything but tasks executed and pushed, which the pool keeps anyway.
+#ifndef TPOOL_STATS
+#define TPOOL_STATS 1
+#endif
+
+// Highest cpu number the topology code will look at when pinning
+#ifndef TPOOL_MAX_CPUS
+#define TPOOL_MAX_CPUS 1024
+#endif
+
+// Sized so a task is exactly 64 bytes
+#define TPOOL_TASK_PAYLOAD (64 - 2 * sizeof(void *))
+// Biggest closure that rides along in the task itself, see tpool_task_closure. args takes the first word, to say
+// where the closure is.
+#define TPOOL_TASK_CLOSURE_MAX (TPOOL_TASK_PAYLOAD - sizeof(void *))
+
+// Low bits of TPoolTask.completion, the rest is the group or future the task reports to (both 8-byte aligned)
+#define TPOOL_TASK_FUTURE    1 // it's a TPoolFuture, not a TPoolGroup
+#define TPOOL_TASK_UNCOUNTED 2 // a continuation attached off the pool, not counted as pushed until tpool_group_seal
+#define TPOOL_TASK_FLAGS     3
+
+// A task you fill in yourself only needs do_work and args, the pool sets everything else when it's pushed
+typedef ssize_t tpool_task_proc(void *data);
+typedef struct TPoolTask {
+	tpool_task_proc *do_work;
+	union {
+		void *args;
+		unsigned char payload[TPOOL_TASK_PAYLOAD];
+	};
+	// set by the pool on every push
+	uintptr_t completion;
+} TPoolTask;
+
+// Counts outstanding tasks pushed with tpool_group_push, so a caller can wait on just those.
+// Zero-initialized is ready to use.
+//
+// Instead of waiting, a task can hand the rest of its work to a continuation that runs once the group drains,
+// and return right away:
+//   tpool_group_then(&frame->group, (TPoolTask){ .do_work = rest, .args = frame });
+//   tpool_group_push(pool, &frame->group, child)...
+//   tpool_group_seal(pool, &frame->group);
+// The continuation takes over whatever group or future the task was reporting to, and gets pushed by whichever
+// thread finishes the last child. Nobody can wait on a group with a continuation, and it belongs to the
+// continuation once sealed, so that's the place to free it.
+typedef struct TPoolGroup {
+	_Atomic int64_t pending; // plus TPOOL_GROUP_WAITING once someone's parked on it
+	TPoolTask then;
+} TPoolGroup;
+
+// Set in TPoolGroup.pending by a waiter before it parks. It's in the same word as the count, so the task that takes
+// the count to zero finds out in the same atomic whether there's anybody to wake, and otherwise doesn't make a call.
+#define TPOOL_GROUP_WAITING ((int64_t)1 << 62)
+
+// Handle for one task spawned with tpool_spawn, holds on to its return value until tpool_future_wait collects it.
+// These come off a per-thread free list, so spawning one doesn't touch malloc once the list has warmed up.
+typedef struct TPoolFuture {
+	_Atomic int64_t done; // TPOOL_FUTURE_DONE, plus TPOOL_FUTURE_WAITING once tpool_future_wait has parked on it
+	ssize_t result;
+	struct TPoolFuture *next_free;
+} TPoolFuture;
+
+// Bits of TPoolFuture.done, the same idea as TPOOL_GROUP_WAITING
+#define TPOOL_FUTURE_DONE    1
+#define TPOOL_FUTURE_WAITING 2
+
+// A set of tasks with "runs after" edges between them, built once and run as many times as you like.
+// Each node's task stays put in the graph, so closures made with tpool_task_closure are good for every run.
+typedef struct TPoolGraphNode {
+	TPoolTask task;
+	ssize_t result;
+
+	int *successors;
+	int successor_count;
+	int successor_capacity;
+	int predecessor_count;
+
+	// reset to predecessor_count at the start of every run
+	_Atomic int64_t pending;
+
+	struct TPoolGraph *graph;
+} TPoolGraphNode;
+
+typedef struct TPoolGraph {
+	TPoolGraphNode *nodes;
+	int node_count;
+	int node_capacity;
+
+	// every node is a task in this, so waiting on the run is waiting on the group
+	TPoolGroup group;
+
+	// roots and acyclicity are worked out again on the first run after any change
+	bool dirty;
+	bool acyclic;
+	int *roots;
+	int root_count;
+} TPoolGraph;
+
+typedef void tpool_for_proc(void *ctx, int64_t begin, int64_t end);
+typedef void tpool_reduce_proc(void *ctx, int64_t begin, int64_t end, void *acc);
+typedef void tpool_join_proc(void *ctx, void *acc, const void *other);
+
+#define TPOOL_FUTURE_BLOCK_SIZE 64
+typedef struct TPoolFutureBlock {
+	struct TPoolFutureBlock *next;
+	TPoolFuture futures[TPOOL_FUTURE_BLOCK_SIZE];
+} TPoolFutureBlock;
+
+// A ring slot is read by thieves while the owner may be overwriting it, so it's stored as relaxed atomic words.
+// A torn read can only happen when the owner has wrapped around past it, in which case the thief's CAS on tail fails
+// and the copy gets thrown away. One task per cache line.
+typedef struct TPoolSlot {
+	TPOOL_ALIGN(TPOOL_CACHE_LINE) _Atomic uintptr_t words[sizeof(TPoolTask) / sizeof(uintptr_t)];
+} TPoolSlot;
+
+typedef struct TQueueBuffer {
+	size_t capacity;
+	struct TQueueBuffer *next_retired;
+	TPoolSlot slots[];
+} TQueueBuffer;
+
+// Closures too big for TPoolTask.payload go in blocks off a per-thread slab, with one free list per size class.
+// A block always goes back to the thread whose slab it came from. If that thread ran the task, it goes straight on
+// its free list. Otherwise it goes on the owner's remote stack, which the owner empties into its free lists when
+// one runs dry, so a thread that spawns more than it runs gets its blocks back instead of growing its slab forever.
+#define TPOOL_SPILL_CLASSES 5 // 128 up to 2048 byte blocks, header included
+#define TPOOL_SPILL_CHUNK (64 * 1024)
+typedef struct TPoolSpill {
+	union {
+		struct TPoolSpill *next_free; // while it's free
+		struct Thread *owner;         // while it's handed out
+	};
+	size_t size_class; // TPOOL_SPILL_CLASSES if it came straight from malloc
+} TPoolSpill;
+
+typedef struct TPoolSpillChunk {
+	struct TPoolSpillChunk *next;
+	size_t pad;
+} TPoolSpillChunk;
+
+// Bounded MPMC ring (Vyukov) for tasks from threads that aren't in the pool. A cell's seq says whose turn it is:
+// pos when it's free for the producer claiming pos, pos + 1 once that task is in and a consumer can have it.
+typedef struct TPoolInjectCell {
+	_Atomic uint64_t seq;
+	TPoolTask task;
+} TPoolInjectCell;
+
+typedef struct TPoolInject {
+	TPOOL_ALIGN(TPOOL_CACHE_LINE) _Atomic uint64_t enqueue_pos;
+	TPOOL_ALIGN(TPOOL_CACHE_LINE) _Atomic uint64_t dequeue_pos;
+	// external threads have no counters of their own, so their pushes are counted here
+	TPOOL_ALIGN(TPOOL_CACHE_LINE) _Atomic uint64_t tasks_pushed;
+	TPoolInjectCell *cells;
+} TPoolInject;
+
+// Chase-Lev work-stealing deque.
+// The owning thread pushes and pops at head (LIFO), thieves take from tail (FIFO) with a single CAS.
+// When the owner grows the buffer, the old one is retired and only freed once no thief is still reading from it.
+typedef struct TQueue {
+	TQueueBuffer *_Atomic buffer;
+	TQueueBuffer *retired;
+	size_t max_capacity;
+
+	// Most tasks tqueue_steal_batch takes at once, 1 unless set right after tqueue_init. Within this many tasks of
+	// tail the owner can't tell whether a thief's batch covers what it's popping, so it races them for tail instead.
+	size_t steal_max;
+
+	_Atomic int64_t head;
+	_Atomic int64_t tail;
+	_Atomic int64_t thieves;
+} TQueue;
+
+// Only ever written by the owning thread, so bumping one is a plain load + store with no RMW.
+// Pushes are counted on the thread that pushed and completions on the thread that ran the task, so the pool is
+// quiescent when the sums match. Each block gets its own cache line so nobody else's traffic lands on it.
+typedef struct TPoolCounters {
+	TPOOL_ALIGN(TPOOL_CACHE_LINE) _Atomic uint64_t tasks_pushed;
+	_Atomic uint64_t tasks_done;
+} TPoolCounters;
+
+// Where a thread sits, read from sysfs when the pool pins its threads. All -1 for threads that float.
+typedef struct TPoolPlace {
+	int cpu;
+	int core;  // unique per physical core, so SMT siblings share it
+	int cache; // lowest cpu sharing our last-level cache
+	int node;
+} TPoolPlace;
+
+// How far a steal had to reach. Thieves try their victims in this order.
+// Threads that aren't pinned don't know where anybody is, so all their steals count as remote.
+enum {
+	TPOOL_STEAL_SMT,
+	TPOOL_STEAL_CACHE,
+	TPOOL_STEAL_NODE,
+	TPOOL_STEAL_REMOTE,
+	TPOOL_STEAL_LEVELS,
+};
+
+// A snapshot of one thread's counters, or the whole pool's, from tpool_thread_stats / tpool_stats.
+// Idle time is spin_ns + park_ns: spinning burns a core, parking costs a wake-up later, tune spin_count between them.
+typedef struct TPoolStats {
+	uint64_t tasks_executed;
+	uint64_t tasks_pushed;
+	uint64_t peak_queue_depth;    // deepest any one of a thread's lanes got, the max over threads for the pool
+
+	uint64_t steal_attempts;      // successful or not
+	uint64_t steals[TPOOL_STEAL_LEVELS];
+	uint64_t tasks_stolen;        // more than steals when stealing half
+	uint64_t steals_lost;         // there was work, but another thread won the CAS on tail for it
+
+	uint64_t spin_ns;
+	uint64_t park_ns;
+	uint64_t parks;
+	uint64_t unparks;             // parked threads this one woke, going by what the futex wake returns. Linux only,
+	                              // nothing else says how many it woke, so it stays 0 elsewhere
+	uint64_t wakes;               // times this thread was woken out of a park
+	uint64_t wake_latency_ns;     // summed from the notify to running again
+	uint64_t wake_latency_max_ns;
+} TPoolStats;
+
+// The live counters behind TPoolStats, minus the ones in TPoolCounters. Owner writes, anyone can read.
+typedef struct TPoolThreadStats {
+	TPOOL_ALIGN(TPOOL_CACHE_LINE) _Atomic uint64_t peak_queue_depth;
+	_Atomic uint64_t steal_attempts;
+	_Atomic uint64_t steals[TPOOL_STEAL_LEVELS];
+	_Atomic uint64_t tasks_stolen;
+	_Atomic uint64_t steals_lost;
+	_Atomic uint64_t spin_ns;
+	_Atomic uint64_t park_ns;
+	_Atomic uint64_t parks;
+	_Atomic uint64_t unparks;
+	_Atomic uint64_t wakes;
+	_Atomic uint64_t wake_latency_ns;
+	_Atomic uint64_t wake_latency_max_ns;
+} TPoolThreadStats;
+
+// Eventcount: lets a thread check a condition and go to sleep without missing a notify that lands in between.
+//   waiter:   key = tevent_prepare_wait(ev); if (condition) tevent_cancel_wait(ev); else tevent_wait(ev, key);
+//   notifier: make the condition true, then tevent_notify_one / tevent_notify_all
+// When nobody's waiting, notifying is a fence and a load.
+typedef struct TPoolEvent {
+	_Atomic uint32_t epoch;
+	_Atomic uint32_t waiters;
+	_Atomic uint64_t notify_ns;
+#if !defined(__linux__) && !_WIN32
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+} TPoolEvent;
+
+// Each thread has one queue per priority. Everything goes in at normal unless pushed with tpool_push_priority.
+enum {
+	TPOOL_PRIORITY_HIGH,
+	TPOOL_PRIORITY_NORMAL,
+	TPOOL_PRIORITY_LOW,
+	TPOOL_PRIORITIES,
+};
+
+typedef struct Thread {
+	pthread_t thread;
+	int idx;
+	// set while the worker's meant to be running, cleared to retire it, see tpool_set_thread_count
+	_Atomic bool active;
+
+	TQueue queues[TPOOL_PRIORITIES];
+
+	struct TPool *pool;
+
+	TPoolCounters counters;
+	TPoolThreadStats stats;
+
+	TPoolPlace place;
+	// every other thread, nearest first, victims[victim_level_end[level - 1]..victim_level_end[level]] are level away
+	int *victims;
+	int victim_level_end[TPOOL_STEAL_LEVELS];
+
+	// owner only, picks where in each level the thief starts looking
+	uint64_t rng;
+	// owner only, for TPOOL_STARVATION_INTERVAL
+	uint32_t picks;
+
+	// owner only, the task we're in the middle of, so tpool_group_then can take over its completion
+	TPoolTask *running;
+
+	// deterministic scheduling: what we're waiting on, while we've given up our turn in the middle of one.
+	// Written by us with the turn, read by whoever has the turn.
+	bool (*suspended_ready)(struct TPool *pool, void *ctx);
+	void *suspended_ctx;
+
+	// owner only
+	TPoolFuture *free_futures;
+	TPoolFutureBlock *future_blocks;
+	TPoolSpill *free_spills[TPOOL_SPILL_CLASSES];
+	TPoolSpillChunk *spill_chunks;
+
+	// our blocks that other threads are done with, pushed by them and taken all at once by us
+	TPOOL_ALIGN(TPOOL_CACHE_LINE) TPoolSpill *_Atomic remote_spills;
+} Thread;
+
+// One step of a deterministic schedule: which thread took a turn, and what it did with it
+enum {
+	TPOOL_PICK_POP,    // ran a task off its own lane
+	TPOOL_PICK_STEAL,  // took count tasks off victim's lane
+	TPOOL_PICK_INJECT, // took count tasks off the injection queue
+	TPOOL_PICK_ENTER,  // pushed, or ran its own code, outside of a task, or carried on after a wait
+};
+typedef struct TPoolPick {
+	uint16_t thread;
+	uint8_t kind;
+	uint8_t lane;
+	uint16_t victim;
+	uint16_t count;
+} TPoolPick;
+
+// Deterministic scheduling, for reproducing bugs and timing runs against a fixed schedule. Pass one in TPoolOptions
+// and the pool only lets one thread at a time take a turn: pick a task and run it, or push from outside a task.
+// Every turn that does something is logged, so a run can be saved and replayed turn for turn. Slow on purpose,
+// the pool runs one task at a time, though a task waiting on a group or future lets others take turns.
+//
+// With seed 0, whoever gets there first takes the next turn, same as the pool normally would, and the log is the
+// only way to reproduce it. Otherwise the seed picks who goes next, and where thieves look first, so the same seed
+// on the same program gives the same schedule, and different seeds shake out different interleavings. (Turns taken
+// from outside a task, like the main thread pushing, wait until nobody's been picked, so programs that push while
+// the pool is busy still need the log.)
+//
+// Tasks have to be deterministic too, given the order they run in. Submits from threads outside the pool and
+// finishes from outside a turn (tpool_group_finish after I/O) come in when they come in, so aren't reproducible.
+typedef struct TPoolSchedule {
+	uint64_t seed;
+	int thread_count;
+
+	TPoolPick *picks;
+	size_t pick_count;
+	size_t pick_capacity;
+
+	// replaying while replay_pos < replay_end, see tpool_schedule_rewind
+	_Atomic int64_t replay_pos;
+	_Atomic int64_t replay_end;
+	bool diverged;
+
+	// the pool's, while it runs: who has the turn, and who the seed picked to go next (-1 for nobody)
+	_Atomic int64_t holder;
+	_Atomic int64_t next;
+	uint64_t rng;
+} TPoolSchedule;
+
+typedef struct TPoolOptions {
+	int child_thread_count;
+
+	// Room to grow to with tpool_set_thread_count, the calling thread included. 0 for no more than we start with.
+	int max_thread_count;
+
+	// Pin every thread, the calling one included, to a cpu of its own, and have thieves go after SMT siblings first,
+	// then the same L3, then the same NUMA node. Fills up one node's cores before using their SMT siblings,
+	// and those before moving to the next node. Linux only, elsewhere this does nothing.
+	bool pin_threads;
+
+	// Thieves take up to half of a victim's queue (at most TPOOL_STEAL_HALF_MAX) and move the rest onto their own.
+	bool steal_half;
+
+	// Record into or replay this schedule, see TPoolSchedule. Has to outlive the pool.
+	TPoolSchedule *schedule;
+} TPoolOptions;
+
+typedef struct TPool {
+	struct Thread *threads;
+
+	// Threads 0..thread_count are running, the rest of the max_thread_count slots are retired or never started.
+	// Retired threads keep their slot, counters and queues, so anything that adds up or looks through every thread
+	// goes up to max_thread_count.
+	_Atomic int thread_count;
+	int max_thread_count;
+	_Atomic bool running;
+
+	bool steal_half;
+
+	TPoolSchedule *schedule;
+
+	bool pinned;
+	// the calling thread's affinity from before we pinned it, put back on destroy
+	unsigned long saved_affinity[TPOOL_MAX_CPUS / (8 * sizeof(unsigned long))];
+
+	_Atomic int64_t spin_count;
+
+	// High priority tasks sitting in any queue, give or take. Bumped before the push and dropped after the take,
+	// so it never reads 0 while one is there. When it's 0, nobody has to go looking through other threads'
+	// high lanes before getting on with their own work.
+	TPOOL_ALIGN(TPOOL_CACHE_LINE) _Atomic int64_t high_pending;
+
+	TPoolInject inject;
+
+	// workers sleep on this until a push
+	TPoolEvent work_available;
+	// tpool_wait sleeps on this until a worker runs out of work
+	TPoolEvent worker_idle;
+	// group and future waits sleep on this until any group or future finishes
+	TPoolEvent completion;
+} TPool;
+
+extern _Thread_local Thread *current_thread;
+
+bool tqueue_init(TQueue *queue, size_t capacity, size_t max_capacity);
+void tqueue_free(TQueue *queue);
+bool tqueue_push(TQueue *queue, TPoolTask task);
+size_t tqueue_push_batch(TQueue *queue, const TPoolTask *tasks, size_t count, struct TPoolGroup *group);
+bool tqueue_pop(TQueue *queue, TPoolTask *task);
+bool tqueue_steal(TQueue *queue, TPoolTask *task);
+size_t tqueue_steal_batch(TQueue *queue, TPoolTask *tasks, size_t max);
+int64_t tqueue_size(TQueue *queue);
+
+TPoolTask tpool_task_closure(tpool_task_proc *do_work, const void *closure, size_t size);
+
+TPool *tpool_init(int child_thread_count);
+TPool *tpool_init_opts(const TPoolOptions *opts);
+void tpool_destroy(TPool *pool);
+bool tpool_set_thread_count(TPool *pool, int thread_count);
+int tpool_thread_count(TPool *pool);
+void tpool_push(TPool *pool, TPoolTask task);
+void tpool_push_priority(TPool *pool, TPoolTask task, int priority);
+bool tpool_try_submit(TPool *pool, TPoolTask task);
+void tpool_submit(TPool *pool, TPoolTask task);
+void tpool_submit_batch(TPool *pool, const TPoolTask *tasks, size_t count);
+bool tpool_try_push(TPool *pool, TPoolTask task);
+void tpool_push_batch(TPool *pool, const TPoolTask *tasks, size_t count);
+void tpool_wait(TPool *pool);
+
+void tpool_group_init(TPoolGroup *group);
+void tpool_group_push(TPool *pool, TPoolGroup *group, TPoolTask task);
+void tpool_group_push_batch(TPool *pool, TPoolGroup *group, const TPoolTask *tasks, size_t count);
+void tpool_group_wait(TPool *pool, TPoolGroup *group);
+void tpool_group_then(TPoolGroup *group, TPoolTask task);
+void tpool_group_seal(TPool *pool, TPoolGroup *group);
+void tpool_group_add(TPoolGroup *group, int64_t count);
+void tpool_group_finish(TPool *pool, TPoolGroup *group);
+
+TPoolFuture *tpool_spawn(TPool *pool, tpool_task_proc *do_work, void *args);
+bool tpool_future_done(TPoolFuture *future);
+ssize_t tpool_future_wait(TPool *pool, TPoolFuture *future);
+
+TPoolGraph *tpool_graph_create(void);
+void tpool_graph_destroy(TPoolGraph *graph);
+int tpool_graph_add(TPoolGraph *graph, TPoolTask task);
+bool tpool_graph_edge(TPoolGraph *graph, int before, int after);
+bool tpool_graph_run(TPool *pool, TPoolGraph *graph);
+void tpool_graph_wait(TPool *pool, TPoolGraph *graph);
+ssize_t tpool_graph_result(TPoolGraph *graph, int node);
+
+void tpool_parallel_for(TPool *pool, int64_t begin, int64_t end, int64_t grain, tpool_for_proc *fn, void *ctx);
+void tpool_parallel_reduce(TPool *pool, int64_t begin, int64_t end, int64_t grain, tpool_reduce_proc *fn, tpool_join_proc *join, void *ctx, void *acc, size_t acc_size);
+
+TPoolSchedule *tpool_schedule_create(uint64_t seed);
+void tpool_schedule_destroy(TPoolSchedule *schedule);
+void tpool_schedule_rewind(TPoolSchedule *schedule);
+bool tpool_schedule_diverged(TPoolSchedule *schedule);
+bool tpool_schedule_save(TPoolSchedule *schedule, const char *path);
+TPoolSchedule *tpool_schedule_load(const char *path);
+
+uint64_t tpool_tasks_pushed(TPool *pool);
+bool tpool_quiescent(TPool *pool);
+void tpool_thread_stats(TPool *pool, int idx, TPoolStats *stats);
+void tpool_stats(TPool *pool, TPoolStats *stats);
+uint64_t tpool_now_ns(void);
+
+#endif // TPOOL_H
+
+#ifdef TPOOL_IMPLEMENTATION
+
+#ifndef TPOOL_IMPLEMENTED
+#define TPOOL_IMPLEMENTED
+
+_Thread_local Thread *current_thread = NULL;
+
+void mutex_init(pthread_mutex_t *mut) {
+	pthread_mutex_init(mut, NULL);
+}
+void mutex_lock(pthread_mutex_t *mut) {
+	pthread_mutex_lock(mut);
+}
+void mutex_unlock(pthread_mutex_t *mut) {
+	pthread_mutex_unlock(mut);
+}
+int mutex_trylock(pthread_mutex_t *mut) {
+	return pthread_mutex_trylock(mut);
+}
+void cond_init(pthread_cond_t *cond) {
+	pthread_cond_init(cond, NULL);
+}
+void cond_broadcast(pthread_cond_t *cond) {
+	pthread_cond_broadcast(cond);
+}
+void cond_signal(pthread_cond_t *cond) {
+	pthread_cond_signal(cond);
+}
+void cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+	pthread_cond_wait(cond, mutex);
+}
+
+// Not zeroed, so the pages stay untouched until whoever uses them first
+static void *tpool__alloc_aligned_uninit(size_t size) {
+#if !_WIN32
+	void *ptr = NULL;
+	if (posix_memalign(&ptr, TPOOL_CACHE_LINE, size)) {
+		return NULL;
+	}
+	return ptr;
+#else
+	return _aligned_malloc(size, TPOOL_CACHE_LINE);
+#endif
+}
+
+static void *tpool__alloc_aligned(size_t size) {
+	void *ptr = tpool__alloc_aligned_uninit(size);
+	if (ptr) {
+		memset(ptr, 0, size);
+	}
+	return ptr;
+}
+
+static void tpool__free_aligned(void *ptr) {
+#if !_WIN32
+	free(ptr);
+#else
+	_aligned_free(ptr);
+#endif
+}
+
+// Sets flag in *word unless it's there already. Returns what was there before.
+static inline int64_t tpool__set_flag(_Atomic int64_t *word, int64_t flag) {
+	int64_t old = atomic_load_explicit(word, memory_order_relaxed);
+	while (!(old & flag) && !atomic_compare_exchange_strong_explicit(word, &old, old | flag, memory_order_seq_cst, memory_order_relaxed)) {
+	}
+	return old;
+}
+
+// Owner only
+static inline void tpool__count(_Atomic uint64_t *counter) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_release);
+}
+static inline void tpool__add(_Atomic uint64_t *counter, uint64_t n) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_release);
+}
+static inline void tpool__max(_Atomic uint64_t *counter, uint64_t n) {
+	if (n > atomic_load_explicit(counter, memory_order_relaxed)) {
+		atomic_store_explicit(counter, n, memory_order_relaxed);
+	}
+}
+
+// Arguments aren't evaluated when stats are off, so they're free to call tpool_now_ns and friends
+#if TPOOL_STATS
+#define TPOOL_STAT_COUNT(thread, field)  tpool__count(&(thread)->stats.field)
+#define TPOOL_STAT_ADD(thread, field, n) tpool__add(&(thread)->stats.field, (n))
+#define TPOOL_STAT_MAX(thread, field, n) tpool__max(&(thread)->stats.field, (n))
+#define TPOOL_STAT_NOW()                 tpool_now_ns()
+#else
+#define TPOOL_STAT_COUNT(thread, field)  ((void)(thread))
+#define TPOOL_STAT_ADD(thread, field, n) ((void)(thread), (void)sizeof(n))
+#define TPOOL_STAT_MAX(thread, field, n) ((void)(thread), (void)sizeof(n))
+#define TPOOL_STAT_NOW()                 ((uint64_t)0)
+#endif
+
+uint64_t tpool_now_ns(void) {
+#if !_WIN32
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#else
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)((double)now.QuadPart * 1000000000.0 / (double)freq.QuadPart);
+#endif
+}
+
+static void tevent_init(TPoolEvent *ev) {
+	atomic_store_explicit(&ev->epoch, 0, memory_order_relaxed);
+	atomic_store_explicit(&ev->waiters, 0, memory_order_relaxed);
+	atomic_store_explicit(&ev->notify_ns, 0, memory_order_relaxed);
+#if !defined(__linux__) && !_WIN32
+	mutex_init(&ev->lock);
+	cond_init(&ev->cond);
+#endif
+}
+
+static uint32_t tevent_prepare_wait(TPoolEvent *ev) {
+	atomic_fetch_add_explicit(&ev->waiters, 1, memory_order_seq_cst);
+	return atomic_load_explicit(&ev->epoch, memory_order_seq_cst);
+}
+
+static void tevent_cancel_wait(TPoolEvent *ev) {
+	atomic_fetch_add_explicit(&ev->waiters, -1, memory_order_relaxed);
+}
+
+// Returns false if we woke up without a notify (only spuriously on platforms that do that)
+static bool tevent_wait(TPoolEvent *ev, uint32_t key) {
+#if defined(__linux__)
+	if (atomic_load_explicit(&ev->epoch, memory_order_acquire) == key) {
+		syscall(SYS_futex, &ev->epoch, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+	}
+#elif _WIN32
+	if (atomic_load_explicit(&ev->epoch, memory_order_acquire) == key) {
+		WaitOnAddress((volatile VOID *)&ev->epoch, &key, sizeof(key), INFINITE);
+	}
+#else
+	mutex_lock(&ev->lock);
+	while (atomic_load_explicit(&ev->epoch, memory_order_acquire) == key) {
+		cond_wait(&ev->cond, &ev->lock);
+	}
+	mutex_unlock(&ev->lock);
+#endif
+	atomic_fetch_add_explicit(&ev->waiters, -1, memory_order_relaxed);
+	return atomic_load_explicit(&ev->epoch, memory_order_acquire) != key;
+}
+
+// Wakes up to count waiters
+static void tevent_notify(TPoolEvent *ev, uint32_t count) {
+	// pairs with the increment in tevent_prepare_wait: either they see our condition, or we see them waiting
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ev->waiters, memory_order_relaxed) == 0) {
+		return;
+	}
+
+#if TPOOL_STATS
+	atomic_store_explicit(&ev->notify_ns, tpool_now_ns(), memory_order_relaxed);
+#endif
+	atomic_fetch_add_explicit(&ev->epoch, 1, memory_order_release);
+#if defined(__linux__)
+	// waiters also counts ones still on their way to sleep, or already woken and not back yet, so only the futex
+	// knows how many this actually woke
+	long woken = syscall(SYS_futex, &ev->epoch, FUTEX_WAKE_PRIVATE, count > INT32_MAX ? INT32_MAX : count, NULL, NULL, 0);
+	if (current_thread && woken > 0) {
+		TPOOL_STAT_ADD(current_thread, unparks, (uint64_t)woken);
+	}
+#elif _WIN32
+	if (count >= atomic_load_explicit(&ev->waiters, memory_order_relaxed)) {
+		WakeByAddressAll((PVOID)&ev->epoch);
+	} else {
+		for (uint32_t i = 0; i < count; i++) {
+			WakeByAddressSingle((PVOID)&ev->epoch);
+		}
+	}
+#else
+	mutex_lock(&ev->lock);
+	if (count >= atomic_load_explicit(&ev->waiters, memory_order_relaxed)) {
+		cond_broadcast(&ev->cond);
+	} else {
+		for (uint32_t i = 0; i < count; i++) {
+			cond_signal(&ev->cond);
+		}
+	}
+	mutex_unlock(&ev->lock);
+#endif
+}
+
+static void tevent_notify_one(TPoolEvent *ev) {
+	tevent_notify(ev, 1);
+}
+static void tevent_notify_all(TPoolEvent *ev) {
+	tevent_notify(ev, UINT32_MAX);
+}
+
+// kind is TPOOL_TASK_FUTURE or 0 for a group, target can be NULL to report to nobody
+static inline void ttask_report_to(TPoolTask *task, void *target, uintptr_t kind) {
+	task->completion = (uintptr_t)target | kind;
+}
+
+// What args points at in a task made by tpool_task_closure. The closure is right after args in the payload,
+// or the word after args points to its slab block. Nobody can set args to these by accident, unlike tag bits
+// in a field that tasks filled in by hand leave uninitialized.
+static char tpool__closure_inline;
+static char tpool__closure_spilled;
+
+// The block a spilled closure lives in, NULL for any other task
+static inline void *ttask_spilled(const TPoolTask *task) {
+	void *data = NULL;
+	if (task->args == &tpool__closure_spilled) {
+		memcpy(&data, task->payload + sizeof(void *), sizeof(data));
+	}
+	return data;
+}
+
+// Calls do_work with its closure, if it has one. *spilled gets the slab block to give back once it's done with.
+static inline ssize_t ttask_call(TPoolTask *task, void **spilled) {
+	void *args = task->args;
+	if (args == &tpool__closure_inline) {
+		args = task->payload + sizeof(void *);
+	} else if (args == &tpool__closure_spilled) {
+		args = ttask_spilled(task);
+		*spilled = args;
+	}
+	return task->do_work(args);
+}
+
+static inline void tslot_store(TPoolSlot *slot, TPoolTask *task) {
+	uintptr_t words[sizeof(TPoolTask) / sizeof(uintptr_t)];
+	memcpy(words, task, sizeof(words));
+	for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+		atomic_store_explicit(&slot->words[i], words[i], memory_order_relaxed);
+	}
+}
+
+static inline void tslot_load(TPoolSlot *slot, TPoolTask *task) {
+	uintptr_t words[sizeof(TPoolTask) / sizeof(uintptr_t)];
+	for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+		words[i] = atomic_load_explicit(&slot->words[i], memory_order_relaxed);
+	}
+	memcpy(task, words, sizeof(words));
+}
+
+static TQueueBuffer *tqueue_buffer_alloc(size_t capacity) {
+	TQueueBuffer *buffer = tpool__alloc_aligned_uninit(sizeof(TQueueBuffer) + sizeof(TPoolSlot) * capacity);
+	if (!buffer) {
+		return NULL;
+	}
+	buffer->capacity = capacity;
+	buffer->next_retired = NULL;
+	return buffer;
+}
+
+// Returns false if the buffer couldn't be allocated. The queue's still usable, it's just always full, so every push
+// fails and the task gets run inline instead.
+bool tqueue_init(TQueue *queue, size_t capacity, size_t max_capacity) {
+	TQueueBuffer *buffer = tqueue_buffer_alloc(capacity);
+	atomic_store_explicit(&queue->buffer, buffer, memory_order_relaxed);
+	queue->retired = NULL;
+	queue->max_capacity = max_capacity;
+	queue->steal_max = 1;
+	atomic_store_explicit(&queue->head, 0, memory_order_relaxed);
+	atomic_store_explicit(&queue->tail, 0, memory_order_relaxed);
+	atomic_store_explicit(&queue->thieves, 0, memory_order_relaxed);
+	return buffer != NULL;
+}
+
+// Owner only. Frees retired buffers if no thief can still be holding one.
+// A thief announces itself before loading the buffer pointer, and the owner swaps the pointer before checking,
+// so a thief that isn't counted here is guaranteed to see the new buffer.
+static void tqueue_reclaim(TQueue *queue) {
+	if (!queue->retired) {
+		return;
+	}
+	if (atomic_load_explicit(&queue->thieves, memory_order_seq_cst) != 0) {
+		return;
+	}
+
+	while (queue->retired) {
+		TQueueBuffer *next = queue->retired->next_retired;
+		tpool__free_aligned(queue->retired);
+		queue->retired = next;
+	}
+}
+
+void tqueue_free(TQueue *queue) {
+	tqueue_reclaim(queue);
+	tpool__free_aligned(atomic_load_explicit(&queue->buffer, memory_order_relaxed));
+	atomic_store_explicit(&queue->buffer, NULL, memory_order_relaxed);
+}
+
+// Owner only. Copies the live range into a buffer twice the size, returns NULL if we're at max_capacity, out of
+// memory, or never had a buffer to begin with.
+static TQueueBuffer *tqueue_grow(TQueue *queue, TQueueBuffer *old, int64_t head, int64_t tail) {
+	if (!old || old->capacity * 2 > queue->max_capacity) {
+		return NULL;
+	}
+
+	TQueueBuffer *buffer = tqueue_buffer_alloc(old->capacity * 2);
+	if (!buffer) {
+		return NULL;
+	}
+	for (int64_t i = tail; i < head; i++) {
+		TPoolTask task;
+		tslot_load(&old->slots[i & (old->capacity - 1)], &task);
+		tslot_store(&buffer->slots[i & (buffer->capacity - 1)], &task);
+	}
+	atomic_store_explicit(&queue->buffer, buffer, memory_order_seq_cst);
+
+	old->next_retired = queue->retired;
+	queue->retired = old;
+	tqueue_reclaim(queue);
+	return buffer;
+}
+
+// Owner only. Returns false if the queue is full and can't grow any further.
+bool tqueue_push(TQueue *queue, TPoolTask task) {
+	int64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	int64_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	TQueueBuffer *buffer = atomic_load_explicit(&queue->buffer, memory_order_relaxed);
+	if (!buffer || (head - tail) >= (int64_t)buffer->capacity) {
+		buffer = tqueue_grow(queue, buffer, head, tail);
+		if (!buffer) {
+			return false;
+		}
+	}
+
+	tslot_store(&buffer->slots[head & (buffer->capacity - 1)], &task);
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return true;
+}
+
+// Owner only. Pushes as many tasks as will fit (growing as needed) and publishes them all with one store to head.
+// If stamp is set, every task gets group and no future, otherwise they go in as they are. Returns how many went in.
+static size_t tqueue__push_batch(TQueue *queue, const TPoolTask *tasks, size_t count, bool stamp, TPoolGroup *group) {
+	int64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	int64_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	TQueueBuffer *buffer = atomic_load_explicit(&queue->buffer, memory_order_relaxed);
+	if (!buffer) {
+		return 0;
+	}
+	while ((size_t)(head - tail) + count > buffer->capacity) {
+		TQueueBuffer *bigger = tqueue_grow(queue, buffer, head, tail);
+		if (!bigger) {
+			break;
+		}
+		buffer = bigger;
+	}
+
+	size_t space = buffer->capacity - (size_t)(head - tail);
+	if (count > space) {
+		count = space;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		TPoolTask task = tasks[i];
+		if (stamp) {
+			ttask_report_to(&task, group, 0);
+		}
+		tslot_store(&buffer->slots[(head + (int64_t)i) & (buffer->capacity - 1)], &task);
+	}
+	atomic_store_explicit(&queue->head, head + (int64_t)count, memory_order_release);
+	return count;
+}
+
+// Every task is stamped with group and no future
+size_t tqueue_push_batch(TQueue *queue, const TPoolTask *tasks, size_t count, TPoolGroup *group) {
+	return tqueue__push_batch(queue, tasks, count, true, group);
+}
+
+// Owner only. Takes the most recently pushed task, or the oldest one when a thief could be about to grab it.
+bool tqueue_pop(TQueue *queue, TPoolTask *task) {
+	for (;;) {
+		int64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed) - 1;
+		atomic_store_explicit(&queue->head, head, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		int64_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+		// empty, put head back
+		if (tail > head) {
+			atomic_store_explicit(&queue->head, head + 1, memory_order_relaxed);
+			tqueue_reclaim(queue);
+			return false;
+		}
+
+		TQueueBuffer *buffer = atomic_load_explicit(&queue->buffer, memory_order_relaxed);
+		if (head - tail >= (int64_t)queue->steal_max) {
+			tslot_load(&buffer->slots[head & (buffer->capacity - 1)], task);
+			return true;
+		}
+
+		// Close enough to tail that a thief might be about to take this one (with steal_max 1, it's the last task).
+		// Race them for the oldest task instead, and if we lose, go around and see what's left.
+		tslot_load(&buffer->slots[tail & (buffer->capacity - 1)], task);
+		bool won = atomic_compare_exchange_strong_explicit(&queue->tail, &tail, tail + 1, memory_order_seq_cst, memory_order_relaxed);
+		atomic_store_explicit(&queue->head, head + 1, memory_order_relaxed);
+		if (won) {
+			return true;
+		}
+	}
+}
+
+// Takes the oldest half of the queue, up to max and the queue's steal_max, with a single CAS on tail.
+// The owner only pops without a CAS when it's at least steal_max past the tail it sees, so it can't be popping
+// anything in here. Returns how many tasks came out, oldest first, 0 if empty, -1 if another thread got there first.
+static int64_t tqueue__steal(TQueue *queue, TPoolTask *tasks, size_t max) {
+	int64_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if (tail >= head) {
+		return 0;
+	}
+
+	size_t count = (size_t)(head - tail + 1) / 2;
+	if (count > queue->steal_max) {
+		count = queue->steal_max;
+	}
+	if (count > max) {
+		count = max;
+	}
+
+	// pin the buffer so the owner can't free it if it grows while we're reading
+	atomic_fetch_add_explicit(&queue->thieves, 1, memory_order_seq_cst);
+	TQueueBuffer *buffer = atomic_load_explicit(&queue->buffer, memory_order_acquire);
+	for (size_t i = 0; i < count; i++) {
+		tslot_load(&buffer->slots[(tail + (int64_t)i) & (buffer->capacity - 1)], &tasks[i]);
+	}
+	atomic_fetch_add_explicit(&queue->thieves, -1, memory_order_release);
+
+	if (!atomic_compare_exchange_strong_explicit(&queue->tail, &tail, tail + (int64_t)count, memory_order_seq_cst, memory_order_relaxed)) {
+		return -1;
+	}
+	return (int64_t)count;
+}
+
+// Any thread. Takes the oldest task, fails if the queue is empty or another thread got there first.
+bool tqueue_steal(TQueue *queue, TPoolTask *task) {
+	return tqueue__steal(queue, task, 1) > 0;
+}
+
+// Any thread. Takes the oldest half of the queue, up to max and the queue's steal_max, with a single CAS on tail.
+// Returns how many tasks came out, oldest first, 0 if empty or another thread got there first.
+size_t tqueue_steal_batch(TQueue *queue, TPoolTask *tasks, size_t max) {
+	int64_t count = tqueue__steal(queue, tasks, max);
+	return count > 0 ? (size_t)count : 0;
+}
+
+// Racy snapshot, only good as a hint
+int64_t tqueue_size(TQueue *queue) {
+	int64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	int64_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	return head > tail ? head - tail : 0;
+}
+
+// Owner only. Takes back every block other threads have returned since last time.
+static void tspill_reclaim(Thread *thread) {
+	TPoolSpill *spill = atomic_exchange_explicit(&thread->remote_spills, NULL, memory_order_acquire);
+	while (spill) {
+		TPoolSpill *next = spill->next_free;
+		spill->next_free = thread->free_spills[spill->size_class];
+		thread->free_spills[spill->size_class] = spill;
+		spill = next;
+	}
+}
+
+static void *tspill_alloc(Thread *thread, size_t size) {
+	size_t size_class = 0;
+	while (size_class < TPOOL_SPILL_CLASSES && sizeof(TPoolSpill) + size > ((size_t)128 << size_class)) {
+		size_class++;
+	}
+
+	// too big for the slab, or not on a pool thread
+	if (!thread || size_class == TPOOL_SPILL_CLASSES) {
+		TPoolSpill *spill = malloc(sizeof(TPoolSpill) + size);
+		if (!spill) {
+			return NULL;
+		}
+		spill->size_class = TPOOL_SPILL_CLASSES;
+		return spill + 1;
+	}
+
+	if (!thread->free_spills[size_class]) {
+		tspill_reclaim(thread);
+	}
+	if (!thread->free_spills[size_class]) {
+		TPoolSpillChunk *chunk = malloc(TPOOL_SPILL_CHUNK);
+		if (!chunk) {
+			return NULL;
+		}
+		chunk->next = thread->spill_chunks;
+		thread->spill_chunks = chunk;
+
+		size_t block_size = (size_t)128 << size_class;
+		for (size_t offset = sizeof(TPoolSpillChunk); offset + block_size <= TPOOL_SPILL_CHUNK; offset += block_size) {
+			TPoolSpill *spill = (TPoolSpill *)((char *)chunk + offset);
+			spill->size_class = size_class;
+			spill->next_free = thread->free_spills[size_class];
+			thread->free_spills[size_class] = spill;
+		}
+	}
+
+	TPoolSpill *spill = thread->free_spills[size_class];
+	thread->free_spills[size_class] = spill->next_free;
+	spill->owner = thread;
+	return spill + 1;
+}
+
+// Any thread, thread is the caller's (NULL off the pool). The owner has to still be around.
+static void tspill_release(Thread *thread, void *data) {
+	TPoolSpill *spill = (TPoolSpill *)data - 1;
+	if (spill->size_class == TPOOL_SPILL_CLASSES) {
+		free(spill);
+		return;
+	}
+
+	Thread *owner = spill->owner;
+	if (owner == thread) {
+		spill->next_free = thread->free_spills[spill->size_class];
+		thread->free_spills[spill->size_class] = spill;
+		return;
+	}
+
+	TPoolSpill *head = atomic_load_explicit(&owner->remote_spills, memory_order_relaxed);
+	do {
+		spill->next_free = head;
+	} while (!atomic_compare_exchange_weak_explicit(&owner->remote_spills, &head, spill, memory_order_release, memory_order_relaxed));
+}
+
+static void tspill_free_chunks(Thread *thread) {
+	while (thread->spill_chunks) {
+		TPoolSpillChunk *next = thread->spill_chunks->next;
+		free(thread->spill_chunks);
+		thread->spill_chunks = next;
+	}
+	memset(thread->free_spills, 0, sizeof(thread->free_spills));
+	atomic_store_explicit(&thread->remote_spills, NULL, memory_order_relaxed);
+}
+
+// Makes a task that calls do_work with a pointer to its own copy of closure. Up to TPOOL_TASK_CLOSURE_MAX bytes
+// ride along in the task itself, bigger ones go in a block off this thread's slab (or malloc, off the pool), which
+// comes back once the task has run. If that allocation fails, do_work comes back NULL.
+// A closure made on one pool's thread has to be pushed to that same pool.
+TPoolTask tpool_task_closure(tpool_task_proc *do_work, const void *closure, size_t size) {
+	// the rest of the payload is left alone, only the closure's bytes get written
+	TPoolTask task;
+	task.do_work = do_work;
+	task.completion = 0;
+	if (size <= TPOOL_TASK_CLOSURE_MAX) {
+		task.args = &tpool__closure_inline;
+		memcpy(task.payload + sizeof(void *), closure, size);
+		return task;
+	}
+
+	void *data = tspill_alloc(current_thread, size);
+	if (!data) {
+		task.do_work = NULL;
+		return task;
+	}
+	memcpy(data, closure, size);
+	task.args = &tpool__closure_spilled;
+	memcpy(task.payload + sizeof(void *), &data, sizeof(data));
+	return task;
+}
+
+// Deterministic scheduling, see TPoolSchedule. Pushes from outside a task take a turn of their own.
+static bool tsched_enter(TPool *pool);
+static void tsched_leave(TPool *pool, bool entered);
+static void tsched_record(TPool *pool, Thread *self, int kind, int lane, int victim, size_t count);
+static bool tsched_can_go(TPool *pool, Thread *self, bool entering);
+
+// Pushes are counted before the task becomes visible. Otherwise a thief could run it and count it done first,
+// and tpool_quiescent could see matching sums while something else is still running.
+static bool tpool__try_push(TPool *pool, TPoolTask task, int priority) {
+	bool entered = tsched_enter(pool);
+	_Atomic uint64_t *pushed = &current_thread->counters.tasks_pushed;
+	tpool__count(pushed);
+	if (priority == TPOOL_PRIORITY_HIGH) {
+		atomic_fetch_add_explicit(&pool->high_pending, 1, memory_order_seq_cst);
+	}
+
+	bool ok = tqueue_push(&current_thread->queues[priority], task);
+	if (ok) {
+		TPOOL_STAT_MAX(current_thread, peak_queue_depth, (uint64_t)tqueue_size(&current_thread->queues[priority]));
+		tevent_notify_one(&pool->work_available);
+	} else {
+		atomic_store_explicit(pushed, atomic_load_explicit(pushed, memory_order_relaxed) - 1, memory_order_relaxed);
+		if (priority == TPOOL_PRIORITY_HIGH) {
+			atomic_fetch_add_explicit(&pool->high_pending, -1, memory_order_relaxed);
+		}
+	}
+	tsched_leave(pool, entered);
+	return ok;
+}
+
+static void tpool__push_counted(TPool *pool, TPoolTask task);
+
+// Drops one from the group. Returns true if that finished it and there are waiters to wake, false if it's still
+// going or its continuation took over. A waiter can reuse the group the moment it sees it finish, so whether
+// there's a continuation has to be read before we let go.
+static bool tgroup_finish_one(TPool *pool, TPoolGroup *group) {
+	bool has_then = group->then.do_work != NULL;
+	int64_t pending = atomic_fetch_add_explicit(&group->pending, -1, memory_order_acq_rel);
+	if ((pending & ~TPOOL_GROUP_WAITING) != 1) {
+		return false;
+	}
+	if (!has_then) {
+		return (pending & TPOOL_GROUP_WAITING) != 0;
+	}
+
+	// nobody else has the group now, the continuation frees it
+	TPoolTask then = group->then;
+	tpool__push_counted(pool, then);
+	return false;
+}
+
+static inline void tpool_run_task(Thread *thread, TPoolTask *task) {
+	TPoolTask *outer = thread->running;
+	thread->running = task;
+	TPOOL_TRACE_TASK_BEGIN((void *)task->do_work);
+	void *spilled = NULL;
+	ssize_t result = ttask_call(task, &spilled);
+	TPOOL_TRACE_TASK_END();
+	thread->running = outer;
+
+	// read after, tpool_group_then might have moved it
+	uintptr_t completion = task->completion;
+	if (spilled) {
+		tspill_release(thread, spilled);
+	}
+	tpool__count(&thread->counters.tasks_done);
+
+	// A waiter can reuse the group or future the moment it sees it finish, so we don't touch either after that,
+	// and the wake goes through the pool instead. Only if someone said they're parked on it, though.
+	bool wake = false;
+	void *target = (void *)(completion & ~(uintptr_t)TPOOL_TASK_FLAGS);
+	if (target && (completion & TPOOL_TASK_FUTURE)) {
+		TPoolFuture *future = target;
+		future->result = result;
+		int64_t done = atomic_fetch_add_explicit(&future->done, TPOOL_FUTURE_DONE, memory_order_acq_rel);
+		wake = (done & TPOOL_FUTURE_WAITING) != 0;
+	} else if (target) {
+		wake = tgroup_finish_one(thread->pool, target);
+	}
+	if (wake) {
+		tevent_notify_all(&thread->pool->completion);
+	}
+}
+
+// If the queue is completely full, the caller pays for it by running the task right away
+static void tpool__push(TPool *pool, TPoolTask task, int priority) {
+	bool entered = tsched_enter(pool);
+	if (!tpool__try_push(pool, task, priority)) {
+		tpool__count(&current_thread->counters.tasks_pushed);
+		tpool_run_task(current_thread, &task);
+	}
+	tsched_leave(pool, entered);
+}
+
+// One publish, one counter update, and only as many wakes as there are tasks for other threads to take
+static void tpool__push_batch(TPool *pool, TPoolGroup *group, const TPoolTask *tasks, size_t count) {
+	bool entered = tsched_enter(pool);
+	if (group) {
+		atomic_fetch_add_explicit(&group->pending, (int64_t)count, memory_order_relaxed);
+	}
+
+	tpool__add(&current_thread->counters.tasks_pushed, count);
+	size_t pushed = tqueue_push_batch(&current_thread->queues[TPOOL_PRIORITY_NORMAL], tasks, count, group);
+	TPOOL_STAT_MAX(current_thread, peak_queue_depth, (uint64_t)tqueue_size(&current_thread->queues[TPOOL_PRIORITY_NORMAL]));
+	if (pushed) {
+		size_t workers = (size_t)(atomic_load_explicit(&pool->thread_count, memory_order_relaxed) - 1);
+		size_t wake = pushed < workers ? pushed : workers;
+		tevent_notify(&pool->work_available, (uint32_t)wake);
+	}
+
+	for (size_t i = pushed; i < count; i++) {
+		TPoolTask task = tasks[i];
+		ttask_report_to(&task, group, 0);
+		tpool_run_task(current_thread, &task);
+	}
+	tsched_leave(pool, entered);
+}
+
+// Any group or future already on the tasks is ignored
+void tpool_push_batch(TPool *pool, const TPoolTask *tasks, size_t count) {
+	tpool__push_batch(pool, NULL, tasks, count);
+}
+
+// Returns false without queueing anything if this thread's queue is at THREAD_QUEUE_MAX_CAP
+bool tpool_try_push(TPool *pool, TPoolTask task) {
+	ttask_report_to(&task, NULL, 0);
+	return tpool__try_push(pool, task, TPOOL_PRIORITY_NORMAL);
+}
+
+void tpool_push(TPool *pool, TPoolTask task) {
+	ttask_report_to(&task, NULL, 0);
+	tpool__push(pool, task, TPOOL_PRIORITY_NORMAL);
+}
+
+// priority is one of TPOOL_PRIORITY_*. Idle threads and the owner alike take higher priorities first, pool-wide.
+void tpool_push_priority(TPool *pool, TPoolTask task, int priority) {
+	ttask_report_to(&task, NULL, 0);
+	tpool__push(pool, task, priority);
+}
+
+/*
+	Injection queue
+
+	How threads outside the pool hand it work, since tpool_push needs to be on a pool thread. Workers look here after
+	their own normal queue and before stealing, and every TPOOL_STARVATION_INTERVAL tasks regardless, taking up to
+	TPOOL_INJECT_BATCH at once.
+*/
+
+static void tinject_init(TPoolInject *inject) {
+	inject->cells = tpool__alloc_aligned(sizeof(TPoolInjectCell) * TPOOL_INJECT_CAP);
+	for (uint64_t i = 0; i < TPOOL_INJECT_CAP; i++) {
+		atomic_store_explicit(&inject->cells[i].seq, i, memory_order_relaxed);
+	}
+	atomic_store_explicit(&inject->enqueue_pos, 0, memory_order_relaxed);
+	atomic_store_explicit(&inject->dequeue_pos, 0, memory_order_relaxed);
+	atomic_store_explicit(&inject->tasks_pushed, 0, memory_order_relaxed);
+}
+
+// Any thread. Returns false if the ring is full.
+static bool tinject_push(TPoolInject *inject, const TPoolTask *task) {
+	uint64_t pos = atomic_load_explicit(&inject->enqueue_pos, memory_order_relaxed);
+	for (;;) {
+		TPoolInjectCell *cell = &inject->cells[pos & (TPOOL_INJECT_CAP - 1)];
+		uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		int64_t diff = (int64_t)(seq - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_strong_explicit(&inject->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				cell->task = *task;
+				atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			// still holding a task from a lap ago
+			return false;
+		} else {
+			pos = atomic_load_explicit(&inject->enqueue_pos, memory_order_relaxed);
+		}
+	}
+}
+
+// Any thread. Claims the run of ready tasks at the front, up to max, with one CAS. Returns how many, in order.
+// A producer that has claimed a cell but not filled it yet holds up everything behind it.
+static size_t tinject_pop_batch(TPoolInject *inject, TPoolTask *tasks, size_t max) {
+	uint64_t pos = atomic_load_explicit(&inject->dequeue_pos, memory_order_relaxed);
+	for (;;) {
+		size_t count = 0;
+		while (count < max) {
+			TPoolInjectCell *cell = &inject->cells[(pos + count) & (TPOOL_INJECT_CAP - 1)];
+			if (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + count + 1) {
+				break;
+			}
+			count++;
+		}
+
+		if (count == 0) {
+			uint64_t now = atomic_load_explicit(&inject->dequeue_pos, memory_order_relaxed);
+			if (now == pos) {
+				return 0;
+			}
+			pos = now;
+			continue;
+		}
+
+		// once we own them, nobody else touches these cells until we hand them back a lap ahead
+		if (atomic_compare_exchange_strong_explicit(&inject->dequeue_pos, &pos, pos + count, memory_order_relaxed, memory_order_relaxed)) {
+			for (size_t i = 0; i < count; i++) {
+				TPoolInjectCell *cell = &inject->cells[(pos + i) & (TPOOL_INJECT_CAP - 1)];
+				tasks[i] = cell->task;
+				atomic_store_explicit(&cell->seq, pos + i + TPOOL_INJECT_CAP, memory_order_release);
+			}
+			return count;
+		}
+	}
+}
+
+// Racy, claimed cells count even before they're filled
+static uint64_t tinject_size(TPoolInject *inject) {
+	uint64_t enqueue = atomic_load_explicit(&inject->enqueue_pos, memory_order_relaxed);
+	uint64_t dequeue = atomic_load_explicit(&inject->dequeue_pos, memory_order_relaxed);
+	return enqueue > dequeue ? enqueue - dequeue : 0;
+}
+
+// For work that came in through the injection queue. With no workers, the only thread that can run it is thread 0,
+// and it could be waiting on anything.
+static void tpool__wake_injected(TPool *pool, size_t count) {
+	int thread_count = atomic_load_explicit(&pool->thread_count, memory_order_relaxed);
+	if (thread_count == 1) {
+		tevent_notify_all(&pool->completion);
+		tevent_notify_all(&pool->worker_idle);
+		return;
+	}
+	size_t workers = (size_t)(thread_count - 1);
+	tevent_notify(&pool->work_available, (uint32_t)(count < workers ? count : workers));
+}
+
+// Any thread, including ones outside the pool. Returns false if the injection queue is full.
+// Groups and futures are pool-thread things, so whatever the task had is dropped.
+bool tpool_try_submit(TPool *pool, TPoolTask task) {
+	ttask_report_to(&task, NULL, 0);
+
+	// counted before it's visible, same as tpool__try_push
+	atomic_fetch_add_explicit(&pool->inject.tasks_pushed, 1, memory_order_seq_cst);
+	if (!tinject_push(&pool->inject, &task)) {
+		atomic_fetch_add_explicit(&pool->inject.tasks_pushed, -1, memory_order_relaxed);
+		return false;
+	}
+	tpool__wake_injected(pool, 1);
+	return true;
+}
+
+// Waits for room if the injection queue is full. From a pool thread, it just pushes instead.
+void tpool_submit(TPool *pool, TPoolTask task) {
+	if (current_thread && current_thread->pool == pool) {
+		tpool_push(pool, task);
+		return;
+	}
+	while (!tpool_try_submit(pool, task)) {
+		sched_yield();
+	}
+}
+
+// Pushes a task that's already been counted as pushed, from any thread
+static void tpool__push_counted(TPool *pool, TPoolTask task) {
+	if (current_thread && current_thread->pool == pool) {
+		bool entered = tsched_enter(pool);
+		if (!tqueue_push(&current_thread->queues[TPOOL_PRIORITY_NORMAL], task)) {
+			tpool_run_task(current_thread, &task);
+			tsched_leave(pool, entered);
+			return;
+		}
+		tsched_leave(pool, entered);
+		tevent_notify_one(&pool->work_available);
+	} else {
+		while (!tinject_push(&pool->inject, &task)) {
+			tpool__wake_injected(pool, SIZE_MAX);
+			sched_yield();
+		}
+		tpool__wake_injected(pool, 1);
+	}
+}
+
+// One pushed count and one round of wakes for the lot
+void tpool_submit_batch(TPool *pool, const TPoolTask *tasks, size_t count) {
+	if (current_thread && current_thread->pool == pool) {
+		tpool_push_batch(pool, tasks, count);
+		return;
+	}
+
+	atomic_fetch_add_explicit(&pool->inject.tasks_pushed, count, memory_order_seq_cst);
+	for (size_t i = 0; i < count; i++) {
+		TPoolTask task = tasks[i];
+		ttask_report_to(&task, NULL, 0);
+		while (!tinject_push(&pool->inject, &task)) {
+			tpool__wake_injected(pool, SIZE_MAX);
+			sched_yield();
+		}
+	}
+	tpool__wake_injected(pool, count);
+}
+
+// Approximate, only good for throttling
+uint64_t tpool_tasks_pushed(TPool *pool) {
+	uint64_t pushed = atomic_load_explicit(&pool->inject.tasks_pushed, memory_order_relaxed);
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		pushed += atomic_load_explicit(&pool->threads[i].counters.tasks_pushed, memory_order_relaxed);
+	}
+	return pushed;
+}
+
+// Exact as long as nothing outside the pool is pushing, otherwise only true as of some moment during the call.
+// Every completion is read before any push count, and a task's push (and the pushes of any children it made) happens
+// before its completion is published, so every task counted as done is also counted as pushed. If the sums are equal,
+// nothing pushed is still in flight, and anything pushed after we looked would have to come from a task in flight.
+bool tpool_quiescent(TPool *pool) {
+	uint64_t done = 0;
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		done += atomic_load_explicit(&pool->threads[i].counters.tasks_done, memory_order_acquire);
+	}
+
+	atomic_thread_fence(memory_order_seq_cst);
+
+	uint64_t pushed = atomic_load_explicit(&pool->inject.tasks_pushed, memory_order_acquire);
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		pushed += atomic_load_explicit(&pool->threads[i].counters.tasks_pushed, memory_order_acquire);
+	}
+
+	return done == pushed;
+}
+
+/*
+	Topology
+
+	Read out of /sys/devices/system/cpu for every cpu we're allowed to run on. We go through raw syscalls for
+	affinity so this header doesn't need _GNU_SOURCE defined before everything else is included.
+*/
+
+#define TPOOL_AFFINITY_WORDS (TPOOL_MAX_CPUS / (8 * sizeof(unsigned long)))
+
+static int tplace_distance(TPoolPlace *a, TPoolPlace *b) {
+	if (a->cpu < 0 || b->cpu < 0) {
+		return TPOOL_STEAL_REMOTE;
+	}
+	if (a->core == b->core) {
+		return TPOOL_STEAL_SMT;
+	}
+	if (a->cache == b->cache) {
+		return TPOOL_STEAL_CACHE;
+	}
+	if (a->node == b->node) {
+		return TPOOL_STEAL_NODE;
+	}
+	return TPOOL_STEAL_REMOTE;
+}
+
+#ifdef __linux__
+static int tpool__read_int(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return -1;
+	}
+	int value;
+	if (fscanf(f, "%d", &value) != 1) {
+		value = -1;
+	}
+	fclose(f);
+	return value;
+}
+
+static bool tpool__get_affinity(unsigned long *mask) {
+	memset(mask, 0, TPOOL_AFFINITY_WORDS * sizeof(unsigned long));
+	return syscall(SYS_sched_getaffinity, 0, TPOOL_AFFINITY_WORDS * sizeof(unsigned long), mask) > 0;
+}
+
+static void tpool__set_affinity(const unsigned long *mask) {
+	syscall(SYS_sched_setaffinity, 0, TPOOL_AFFINITY_WORDS * sizeof(unsigned long), mask);
+}
+
+static void tplace_read(TPoolPlace *place, int cpu) {
+	char path[256];
+	place->cpu = cpu;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+	int package = tpool__read_int(path);
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+	int core = tpool__read_int(path);
+	place->core = (package < 0 || core < 0) ? -2 - cpu : package * 65536 + core;
+
+	// the highest cache level is the one shared the widest, and shared_cpu_list starts with its lowest cpu
+	int best_level = 0;
+	place->cache = -2 - cpu;
+	for (int i = 0; i < 16; i++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, i);
+		int level = tpool__read_int(path);
+		if (level < 0) {
+			break;
+		}
+		if (level < best_level) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, i);
+		int first = tpool__read_int(path);
+		if (first >= 0) {
+			best_level = level;
+			place->cache = first;
+		}
+	}
+
+	place->node = 0;
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR *dir = opendir(path);
+	if (dir) {
+		struct dirent *entry;
+		while ((entry = readdir(dir))) {
+			int node;
+			if (sscanf(entry->d_name, "node%d", &node) == 1) {
+				place->node = node;
+				break;
+			}
+		}
+		closedir(dir);
+	}
+}
+#endif
+
+typedef struct TPoolPlaceOrder {
+	TPoolPlace place;
+	int smt_rank;
+} TPoolPlaceOrder;
+
+static int tplace_order_cmp(const void *a, const void *b) {
+	const TPoolPlaceOrder *x = a;
+	const TPoolPlaceOrder *y = b;
+	if (x->place.node != y->place.node) return x->place.node < y->place.node ? -1 : 1;
+	if (x->smt_rank != y->smt_rank) return x->smt_rank < y->smt_rank ? -1 : 1;
+	if (x->place.cache != y->place.cache) return x->place.cache < y->place.cache ? -1 : 1;
+	if (x->place.core != y->place.core) return x->place.core < y->place.core ? -1 : 1;
+	return (x->place.cpu > y->place.cpu) - (x->place.cpu < y->place.cpu);
+}
+
+// Every cpu we're allowed on, in the order threads get placed on them. Returns how many, 0 if we can't tell.
+static int tpool__topology(TPoolPlace *places) {
+#ifdef __linux__
+	unsigned long mask[TPOOL_AFFINITY_WORDS];
+	if (!tpool__get_affinity(mask)) {
+		return 0;
+	}
+
+	TPoolPlaceOrder *order = malloc(sizeof(TPoolPlaceOrder) * TPOOL_MAX_CPUS);
+	if (!order) {
+		return 0;
+	}
+	int count = 0;
+	for (int cpu = 0; cpu < TPOOL_MAX_CPUS; cpu++) {
+		if (mask[cpu / (8 * sizeof(unsigned long))] & (1UL << (cpu % (8 * sizeof(unsigned long))))) {
+			tplace_read(&order[count].place, cpu);
+			count++;
+		}
+	}
+	// cpus come out ascending, so each one's rank is how many siblings we've already seen
+	for (int i = 0; i < count; i++) {
+		order[i].smt_rank = 0;
+		for (int j = 0; j < i; j++) {
+			order[i].smt_rank += order[j].place.core == order[i].place.core;
+		}
+	}
+
+	qsort(order, count, sizeof(TPoolPlaceOrder), tplace_order_cmp);
+	for (int i = 0; i < count; i++) {
+		places[i] = order[i].place;
+	}
+	free(order);
+	return count;
+#else
+	return 0;
+#endif
+}
+
+static void tplace_pin(TPoolPlace *place) {
+#ifdef __linux__
+	if (place->cpu < 0) {
+		return;
+	}
+	unsigned long mask[TPOOL_AFFINITY_WORDS] = {0};
+	mask[place->cpu / (8 * sizeof(unsigned long))] = 1UL << (place->cpu % (8 * sizeof(unsigned long)));
+	tpool__set_affinity(mask);
+#endif
+}
+
+// Victims sorted by distance. Within a level the order doesn't matter, thieves start somewhere random. Every slot
+// is in there, whether it's running or not, and the ones that aren't have empty queues that get skipped over.
+static void tpool__sort_victims(TPool *pool, Thread *thread) {
+	int n = pool->max_thread_count;
+	int k = 0;
+	for (int level = 0; level < TPOOL_STEAL_LEVELS; level++) {
+		for (int i = 1; i < n; i++) {
+			int idx = (thread->idx + i) % n;
+			if (tplace_distance(&thread->place, &pool->threads[idx].place) == level) {
+				thread->victims[k++] = idx;
+			}
+		}
+		thread->victim_level_end[level] = k;
+	}
+}
+
+// Racy, only tells an idle thread whether it's worth going around again
+static bool tpool__has_work(TPool *pool) {
+	if (tinject_size(&pool->inject) > 0) {
+		return true;
+	}
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		for (int lane = 0; lane < TPOOL_PRIORITIES; lane++) {
+			if (tqueue_size(&pool->threads[i].queues[lane]) > 0) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Scheduling deterministically, work is only worth waking for when it's our turn to go and get it
+static bool tpool_has_visible_work(TPool *pool) {
+	if (pool->schedule) {
+		return tsched_can_go(pool, current_thread, false);
+	}
+	return tpool__has_work(pool);
+}
+
+// xorshift64
+static inline uint64_t tpool__rand(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+static bool tpool_steal_from(TPool *pool, Thread *victim, int lane, int level) {
+	Thread *self = current_thread;
+	TQueue *queue = &victim->queues[lane];
+	TPoolTask tasks[TPOOL_STEAL_HALF_MAX];
+
+	TPOOL_STAT_COUNT(self, steal_attempts);
+	int64_t stolen = tqueue__steal(queue, tasks, pool->steal_half ? TPOOL_STEAL_HALF_MAX : 1);
+	if (stolen <= 0) {
+		if (stolen < 0) {
+			TPOOL_STAT_COUNT(self, steals_lost);
+		}
+		return false;
+	}
+	size_t count = (size_t)stolen;
+	if (pool->schedule) {
+		tsched_record(pool, self, TPOOL_PICK_STEAL, lane, victim->idx, count);
+	}
+	TPOOL_TRACE_STEAL(victim->idx, self->idx, count);
+	TPOOL_STAT_COUNT(self, steals[level]);
+	TPOOL_STAT_ADD(self, tasks_stolen, count);
+
+	// Keep the oldest, the rest go on our queue where other thieves can get at them. They're already counted as
+	// pushed, so moving them doesn't touch the counters, and anything that doesn't fit just runs here.
+	size_t moved = count > 1 ? tqueue__push_batch(&self->queues[lane], tasks + 1, count - 1, false, NULL) : 0;
+	TPOOL_STAT_MAX(self, peak_queue_depth, (uint64_t)tqueue_size(&self->queues[lane]));
+	if (lane == TPOOL_PRIORITY_HIGH) {
+		atomic_fetch_add_explicit(&pool->high_pending, -(int64_t)(count - moved), memory_order_relaxed);
+	}
+
+	// pushes only wake one worker, so if there's more where that came from, pass it on
+	if (moved || tqueue_size(queue) > 0) {
+		tevent_notify_one(&pool->work_available);
+	}
+
+	tpool_run_task(self, &tasks[0]);
+	for (size_t i = 1 + moved; i < count; i++) {
+		tpool_run_task(self, &tasks[i]);
+	}
+	return true;
+}
+
+// Goes through victims nearest first, and starts each level at a random one so starving thieves spread out
+static bool tpool_steal_lane(TPool *pool, int lane) {
+	Thread *self = current_thread;
+	int start = 0;
+	for (int level = 0; level < TPOOL_STEAL_LEVELS; level++) {
+		int end = self->victim_level_end[level];
+		int count = end - start;
+		if (count > 0) {
+			int offset = (int)(tpool__rand(&self->rng) % (uint64_t)count);
+			for (int i = 0; i < count; i++) {
+				Thread *victim = &pool->threads[self->victims[start + (offset + i) % count]];
+				if (tqueue_size(&victim->queues[lane]) > 0 && tpool_steal_from(pool, victim, lane, level)) {
+					return true;
+				}
+			}
+		}
+		start = end;
+	}
+	return false;
+}
+
+// Runs the first of a batch off the injection queue, the rest go on our normal queue like a steal-half would
+static bool tpool_run_injected(TPool *pool) {
+	Thread *self = current_thread;
+	if (tinject_size(&pool->inject) == 0) {
+		return false;
+	}
+
+	TPoolTask tasks[TPOOL_INJECT_BATCH];
+	size_t count = tinject_pop_batch(&pool->inject, tasks, TPOOL_INJECT_BATCH);
+	if (!count) {
+		return false;
+	}
+	if (pool->schedule) {
+		tsched_record(pool, self, TPOOL_PICK_INJECT, TPOOL_PRIORITY_NORMAL, self->idx, count);
+	}
+
+	size_t moved = count > 1 ? tqueue__push_batch(&self->queues[TPOOL_PRIORITY_NORMAL], tasks + 1, count - 1, false, NULL) : 0;
+	TPOOL_STAT_MAX(self, peak_queue_depth, (uint64_t)tqueue_size(&self->queues[TPOOL_PRIORITY_NORMAL]));
+	if (moved || tinject_size(&pool->inject) > 0) {
+		tevent_notify_one(&pool->work_available);
+	}
+
+	tpool_run_task(self, &tasks[0]);
+	for (size_t i = 1 + moved; i < count; i++) {
+		tpool_run_task(self, &tasks[i]);
+	}
+	return true;
+}
+
+static bool tpool_run_own(TPool *pool, int lane) {
+	Thread *self = current_thread;
+	TPoolTask task;
+	if (!tqueue_pop(&self->queues[lane], &task)) {
+		return false;
+	}
+	if (lane == TPOOL_PRIORITY_HIGH) {
+		atomic_fetch_add_explicit(&pool->high_pending, -1, memory_order_relaxed);
+	}
+	if (pool->schedule) {
+		tsched_record(pool, self, TPOOL_PICK_POP, lane, self->idx, 1);
+	}
+	tpool_run_task(self, &task);
+	return true;
+}
+
+// Our own queue for this priority first, then everyone else's
+static bool tpool_run_lane(TPool *pool, int lane) {
+	if (tpool_run_own(pool, lane)) {
+		return true;
+	}
+
+	// submissions from outside the pool come in at normal priority
+	if (lane == TPOOL_PRIORITY_NORMAL && tpool_run_injected(pool)) {
+		return true;
+	}
+
+	if (lane == TPOOL_PRIORITY_HIGH && atomic_load_explicit(&pool->high_pending, memory_order_relaxed) <= 0) {
+		return false;
+	}
+	return tpool_steal_lane(pool, lane);
+}
+
+// Racy, for tracing
+static inline int64_t tpool__queued(Thread *thread) {
+	int64_t queued = 0;
+	for (int lane = 0; lane < TPOOL_PRIORITIES; lane++) {
+		queued += tqueue_size(&thread->queues[lane]);
+	}
+	return queued;
+}
+
+// Runs the most important task it can find anywhere in the pool, newest first off our own queues, otherwise stolen.
+// Returns false if we found nothing at all.
+static bool tpool__run_one(TPool *pool) {
+	Thread *self = current_thread;
+
+	self->picks++;
+	if (self->picks % TPOOL_TRACE_DEPTH_INTERVAL == 0) {
+		TPOOL_TRACE_QUEUE_DEPTH(tpool__queued(self));
+	}
+	if (self->picks % TPOOL_STARVATION_INTERVAL == 0) {
+		if (tpool_run_injected(pool) || tpool_run_lane(pool, TPOOL_PRIORITIES - 1)) {
+			return true;
+		}
+	}
+
+	for (int lane = 0; lane < TPOOL_PRIORITIES; lane++) {
+		if (tpool_run_lane(pool, lane)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+#if TPOOL_STATS
+static void tpool_account_wake(Thread *thread, TPoolEvent *ev, uint64_t now) {
+	uint64_t latency = now - atomic_load_explicit(&ev->notify_ns, memory_order_relaxed);
+	TPOOL_STAT_COUNT(thread, wakes);
+	TPOOL_STAT_ADD(thread, wake_latency_ns, latency);
+	TPOOL_STAT_MAX(thread, wake_latency_max_ns, latency);
+}
+#endif
+
+typedef bool tpool_ready_proc(TPool *pool, void *ctx);
+
+// Spin for a bit in case work shows up right away, then sleep on ev.
+// Returns as soon as ready() says so or there's work visible anywhere in the pool.
+static void tpool_park(TPool *pool, TPoolEvent *ev, tpool_ready_proc *ready, void *ctx) {
+	Thread *self = current_thread;
+	uint64_t idle_start = TPOOL_STAT_NOW();
+
+	int64_t spin_count = atomic_load_explicit(&pool->spin_count, memory_order_relaxed);
+	for (int64_t i = 0; i < spin_count; i++) {
+		if (ready(pool, ctx) || tpool_has_visible_work(pool)) {
+			TPOOL_STAT_ADD(self, spin_ns, tpool_now_ns() - idle_start);
+			return;
+		}
+		tpool__pause();
+	}
+
+	uint32_t key = tevent_prepare_wait(ev);
+	if (ready(pool, ctx) || tpool_has_visible_work(pool)) {
+		tevent_cancel_wait(ev);
+		TPOOL_STAT_ADD(self, spin_ns, tpool_now_ns() - idle_start);
+		return;
+	}
+
+	uint64_t park_start = TPOOL_STAT_NOW();
+	TPOOL_STAT_ADD(self, spin_ns, park_start - idle_start);
+	TPOOL_STAT_COUNT(self, parks);
+
+	TPOOL_TRACE_PARK_BEGIN();
+	bool notified = tevent_wait(ev, key);
+	TPOOL_TRACE_PARK_END();
+
+#if TPOOL_STATS
+	uint64_t park_end = tpool_now_ns();
+	TPOOL_STAT_ADD(self, park_ns, park_end - park_start);
+	if (notified) {
+		tpool_account_wake(self, ev, park_end);
+	}
+#else
+	(void)notified;
+#endif
+}
+
+/*
+	Deterministic scheduling
+
+	The turn is a lock in all but name: holder is whoever has it, and only they touch a queue or run a task. Pushes
+	from outside a task take a turn, and a thread that waits in the middle of a turn hands it on and asks for it back
+	once its wait is over, so with one task running at a time the order of turns is the whole story. Taking the
+	turn is logged as whatever happens on it, which is all a replay has to enforce.
+*/
+
+static uint64_t tsched__mix(uint64_t x) {
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+static bool tsched_replaying(TPoolSchedule *sched) {
+	return atomic_load_explicit(&sched->replay_pos, memory_order_acquire) < atomic_load_explicit(&sched->replay_end, memory_order_acquire);
+}
+
+// Whether the turn is ours to take, once it's free. Racy until we have it.
+static bool tsched_is_ours(TPool *pool, Thread *self) {
+	TPoolSchedule *sched = pool->schedule;
+	if (tsched_replaying(sched)) {
+		int64_t pos = atomic_load_explicit(&sched->replay_pos, memory_order_acquire);
+		return sched->picks[pos].thread == self->idx;
+	}
+	int64_t next = atomic_load_explicit(&sched->next, memory_order_acquire);
+	return next < 0 || next == self->idx;
+}
+
+// entering is for taking a turn to push or carry on, otherwise it's for finding work, and only worth it when
+// there's work about or a wait of ours has finished. Racy.
+static bool tsched_can_go(TPool *pool, Thread *self, bool entering) {
+	TPoolSchedule *sched = pool->schedule;
+	if (atomic_load_explicit(&sched->holder, memory_order_acquire) >= 0 || !tsched_is_ours(pool, self)) {
+		return false;
+	}
+	if (entering || tsched_replaying(sched) || atomic_load_explicit(&sched->next, memory_order_relaxed) == self->idx) {
+		return true;
+	}
+	return tpool__has_work(pool) || (self->suspended_ready && self->suspended_ready(pool, self->suspended_ctx));
+}
+
+static void tsched_release(TPool *pool) {
+	TPoolSchedule *sched = pool->schedule;
+
+	// Pick who goes next, out of everyone who'd have something to do: any worker or waiting thread if there's
+	// work, any thread whose wait is over. The calling thread isn't a worker, it runs its own code otherwise.
+	int64_t next = -1;
+	if (sched->seed && !tsched_replaying(sched)) {
+		bool has_work = tpool__has_work(pool);
+		int candidates = 0;
+		for (int pass = 0; pass < 2; pass++) {
+			int pick = pass ? (int)(tpool__rand(&sched->rng) % (uint64_t)candidates) : -1;
+			int seen = 0;
+			int thread_count = atomic_load_explicit(&pool->thread_count, memory_order_relaxed);
+			for (int i = 0; i < thread_count; i++) {
+				Thread *thread = &pool->threads[i];
+				bool waiting = thread->suspended_ready != NULL;
+				bool candidate = (has_work && (i > 0 || waiting || thread_count == 1)) ||
+				                 (waiting && thread->suspended_ready(pool, thread->suspended_ctx));
+				if (candidate && seen++ == pick) {
+					next = i;
+				}
+			}
+			candidates = seen;
+			if (!candidates) {
+				break;
+			}
+		}
+	}
+	atomic_store_explicit(&sched->next, next, memory_order_relaxed);
+	atomic_store_explicit(&sched->holder, -1, memory_order_release);
+
+	// whoever's turn it is could be parked on any of these
+	tevent_notify_all(&pool->work_available);
+	tevent_notify_all(&pool->completion);
+	tevent_notify_all(&pool->worker_idle);
+}
+
+static bool tsched_try_acquire(TPool *pool, Thread *self, bool entering) {
+	TPoolSchedule *sched = pool->schedule;
+	if (!tsched_can_go(pool, self, entering)) {
+		return false;
+	}
+	int64_t free_turn = -1;
+	if (!atomic_compare_exchange_strong_explicit(&sched->holder, &free_turn, self->idx, memory_order_acquire, memory_order_relaxed)) {
+		return false;
+	}
+
+	// someone else's turn after all, hand it straight back without picking anybody new
+	if (!tsched_is_ours(pool, self)) {
+		atomic_store_explicit(&sched->holder, -1, memory_order_release);
+		tevent_notify_all(&pool->work_available);
+		tevent_notify_all(&pool->completion);
+		tevent_notify_all(&pool->worker_idle);
+		return false;
+	}
+	atomic_store_explicit(&sched->next, -1, memory_order_relaxed);
+	return true;
+}
+
+static bool tsched_holding(TPool *pool, Thread *self) {
+	return atomic_load_explicit(&pool->schedule->holder, memory_order_relaxed) == self->idx;
+}
+
+// Logs a pick, or checks it against the replay. A replay that goes somewhere else is abandoned, and the rest of
+// the run schedules itself.
+static void tsched_record(TPool *pool, Thread *self, int kind, int lane, int victim, size_t count) {
+	TPoolSchedule *sched = pool->schedule;
+	TPoolPick pick = { (uint16_t)self->idx, (uint8_t)kind, (uint8_t)lane, (uint16_t)victim, (uint16_t)(count > UINT16_MAX ? UINT16_MAX : count) };
+
+	int64_t pos = atomic_load_explicit(&sched->replay_pos, memory_order_relaxed);
+	if (pos < atomic_load_explicit(&sched->replay_end, memory_order_relaxed)) {
+		if (memcmp(&sched->picks[pos], &pick, sizeof(pick)) != 0) {
+			sched->diverged = true;
+			atomic_store_explicit(&sched->replay_end, 0, memory_order_release);
+			return;
+		}
+		atomic_store_explicit(&sched->replay_pos, pos + 1, memory_order_release);
+		return;
+	}
+	if (atomic_load_explicit(&sched->replay_end, memory_order_relaxed) > 0 || sched->diverged) {
+		// done replaying, the log stays as it was
+		return;
+	}
+
+	if (sched->pick_count == sched->pick_capacity) {
+		size_t capacity = sched->pick_capacity ? sched->pick_capacity * 2 : 4096;
+		TPoolPick *picks = realloc(sched->picks, sizeof(TPoolPick) * capacity);
+		if (!picks) {
+			// can't log it, so the log can't be replayed past here
+			sched->diverged = true;
+			return;
+		}
+		sched->picks = picks;
+		sched->pick_capacity = capacity;
+	}
+	sched->picks[sched->pick_count++] = pick;
+}
+
+static bool tpool_ready_enter(TPool *pool, void *ctx) {
+	(void)ctx;
+	return tsched_can_go(pool, current_thread, true);
+}
+
+// Takes a turn for a thread that's outside of a task, returns whether it did (false if we already have it)
+static bool tsched_enter(TPool *pool) {
+	Thread *self = current_thread;
+	if (!pool->schedule || !self || tsched_holding(pool, self)) {
+		return false;
+	}
+	while (!tsched_try_acquire(pool, self, true)) {
+		tpool_park(pool, &pool->work_available, tpool_ready_enter, NULL);
+	}
+	tsched_record(pool, self, TPOOL_PICK_ENTER, 0, self->idx, 0);
+	return true;
+}
+
+static void tsched_leave(TPool *pool, bool entered) {
+	if (entered) {
+		tsched_release(pool);
+	}
+}
+
+// Picks and runs one task on a turn of its own
+static bool tsched_run_one(TPool *pool) {
+	Thread *self = current_thread;
+	if (tsched_holding(pool, self)) {
+		return tpool__run_one(pool);
+	}
+	if (!tsched_try_acquire(pool, self, false)) {
+		return false;
+	}
+
+	bool replaying = tsched_replaying(pool->schedule);
+	bool ran = tpool__run_one(pool);
+	if (!ran && replaying) {
+		// it was our turn and there was nothing to do, the replay's lost
+		pool->schedule->diverged = true;
+		atomic_store_explicit(&pool->schedule->replay_end, 0, memory_order_release);
+	}
+	tsched_release(pool);
+	return ran;
+}
+
+static bool tpool_run_one(TPool *pool) {
+	if (pool->schedule) {
+		return tsched_run_one(pool);
+	}
+	return tpool__run_one(pool);
+}
+
+typedef struct TSchedWait {
+	tpool_ready_proc *ready;
+	void *ctx;
+	bool suspended;
+} TSchedWait;
+
+static bool tsched_wait_ready(TPool *pool, void *ctx) {
+	TSchedWait *wait = (TSchedWait *)ctx;
+	return (!wait->suspended && wait->ready(pool, wait->ctx)) || tsched_can_go(pool, current_thread, false);
+}
+
+// The wait loops, a turn at a time. Waiting in the middle of a turn gives it up, and the wait isn't over until
+// we've been given it back, so whatever comes after carries on as part of the schedule.
+static void tsched_wait(TPool *pool, TPoolEvent *ev, tpool_ready_proc *ready, void *ctx) {
+	Thread *self = current_thread;
+	TSchedWait wait = { ready, ctx, tsched_holding(pool, self) };
+	tpool_ready_proc *outer_ready = self->suspended_ready;
+	void *outer_ctx = self->suspended_ctx;
+	if (wait.suspended) {
+		if (ready(pool, ctx)) {
+			return;
+		}
+		// a task we run while we wait can wait too, it puts ours back when it's done
+		self->suspended_ready = ready;
+		self->suspended_ctx = ctx;
+		tsched_release(pool);
+	}
+
+	for (;;) {
+		if (!wait.suspended && ready(pool, ctx)) {
+			return;
+		}
+		if (tsched_try_acquire(pool, self, false)) {
+			if (ready(pool, ctx)) {
+				if (wait.suspended) {
+					self->suspended_ready = outer_ready;
+					self->suspended_ctx = outer_ctx;
+					tsched_record(pool, self, TPOOL_PICK_ENTER, 0, self->idx, 0);
+				} else {
+					tsched_release(pool);
+				}
+				return;
+			}
+
+			bool replaying = tsched_replaying(pool->schedule);
+			bool ran = tpool__run_one(pool);
+			if (!ran && replaying) {
+				pool->schedule->diverged = true;
+				atomic_store_explicit(&pool->schedule->replay_end, 0, memory_order_release);
+			}
+			tsched_release(pool);
+			if (ran) {
+				continue;
+			}
+		}
+		tpool_park(pool, ev, tsched_wait_ready, &wait);
+	}
+}
+
+TPoolSchedule *tpool_schedule_create(uint64_t seed) {
+	TPoolSchedule *schedule = calloc(sizeof(TPoolSchedule), 1);
+	if (schedule) {
+		schedule->seed = seed;
+	}
+	return schedule;
+}
+
+void tpool_schedule_destroy(TPoolSchedule *schedule) {
+	free(schedule->picks);
+	free(schedule);
+}
+
+// Sets the schedule up to replay what it's recorded on the next pool it's given to
+void tpool_schedule_rewind(TPoolSchedule *schedule) {
+	atomic_store_explicit(&schedule->replay_pos, 0, memory_order_relaxed);
+	atomic_store_explicit(&schedule->replay_end, (int64_t)schedule->pick_count, memory_order_relaxed);
+	schedule->diverged = false;
+}
+
+// True if a replay didn't go the way the recording did, or a recording couldn't keep up
+bool tpool_schedule_diverged(TPoolSchedule *schedule) {
+	return schedule->diverged;
+}
+
+#define TPOOL_SCHEDULE_MAGIC 0x43535054 // "TPSC"
+
+// Native byte order, it's for the same program on the same machine
+bool tpool_schedule_save(TPoolSchedule *schedule, const char *path) {
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		return false;
+	}
+	uint32_t header[2] = { TPOOL_SCHEDULE_MAGIC, (uint32_t)schedule->thread_count };
+	uint64_t sizes[2] = { schedule->seed, schedule->pick_count };
+	bool ok = fwrite(header, sizeof(header), 1, file) == 1 && fwrite(sizes, sizeof(sizes), 1, file) == 1 &&
+	          fwrite(schedule->picks, sizeof(TPoolPick), schedule->pick_count, file) == schedule->pick_count;
+	return fclose(file) == 0 && ok;
+}
+
+// Comes back rewound, ready to replay
+TPoolSchedule *tpool_schedule_load(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		return NULL;
+	}
+
+	uint32_t header[2];
+	uint64_t sizes[2];
+	TPoolSchedule *schedule = NULL;
+	if (fread(header, sizeof(header), 1, file) == 1 && header[0] == TPOOL_SCHEDULE_MAGIC &&
+	    fread(sizes, sizeof(sizes), 1, file) == 1 && sizes[1] <= SIZE_MAX / sizeof(TPoolPick)) {
+		schedule = tpool_schedule_create(sizes[0]);
+		if (schedule) {
+			schedule->thread_count = (int)header[1];
+			schedule->picks = malloc(sizeof(TPoolPick) * (sizes[1] ? sizes[1] : 1));
+			schedule->pick_count = schedule->pick_capacity = (size_t)sizes[1];
+			if (!schedule->picks || fread(schedule->picks, sizeof(TPoolPick), schedule->pick_count, file) != schedule->pick_count) {
+				tpool_schedule_destroy(schedule);
+				schedule = NULL;
+			}
+		}
+	}
+	fclose(file);
+
+	if (schedule) {
+		tpool_schedule_rewind(schedule);
+	}
+	return schedule;
+}
+
+// For workers, on the pool shutting down or them being retired
+static bool tpool_stopping(TPool *pool, void *ctx) {
+	(void)ctx;
+	return !atomic_load_explicit(&pool->running, memory_order_acquire) ||
+	       !atomic_load_explicit(&current_thread->active, memory_order_acquire);
+}
+
+// A worker that's started before, and retired, keeps its queues. Thieves could be looking at them.
+// If the first buffer can't be allocated, the queue stays empty and everything pushed to it runs inline, and we try
+// again next time the worker starts.
+static void thread_init_queues(Thread *thread) {
+	if (atomic_load_explicit(&thread->queues[0].buffer, memory_order_relaxed)) {
+		return;
+	}
+	for (int lane = 0; lane < TPOOL_PRIORITIES; lane++) {
+		tqueue_init(&thread->queues[lane], THREAD_QUEUE_CAP, THREAD_QUEUE_MAX_CAP);
+		thread->queues[lane].steal_max = thread->pool->steal_half ? TPOOL_STEAL_HALF_MAX : 1;
+	}
+}
+
+void *tpool_worker(void *ptr) {
+	current_thread = (Thread *)ptr;
+	TPool *pool = current_thread->pool;
+
+	// pin first, so the queues get first-touched on our own node. Until then head == tail and thieves leave them alone.
+	tplace_pin(&current_thread->place);
+	thread_init_queues(current_thread);
+
+	TPOOL_THREAD_INIT(current_thread->idx);
+
+	while (!tpool_stopping(pool, NULL)) {
+		if (tpool_run_one(pool)) {
+			continue;
+		}
+
+		// we might have just finished the last task, let tpool_wait have a look
+		tevent_notify_all(&pool->worker_idle);
+		tpool_park(pool, &pool->work_available, tpool_stopping, NULL);
+	}
+
+	if (atomic_load_explicit(&pool->running, memory_order_acquire)) {
+		// Retired. Only we can pop our queues, so run them dry first, and if we got woken for work we're not
+		// going to do, pass it on.
+		for (int lane = 0; lane < TPOOL_PRIORITIES;) {
+			if (!tpool_run_own(pool, lane)) {
+				lane++;
+			} else {
+				lane = 0;
+			}
+		}
+		if (tpool__has_work(pool)) {
+			tevent_notify_one(&pool->work_available);
+		}
+		tevent_notify_all(&pool->worker_idle);
+	}
+
+	TPOOL_THREAD_QUIT();
+	return NULL;
+}
+
+static bool tpool_ready_quiescent(TPool *pool, void *ctx) {
+	(void)ctx;
+	return tpool_quiescent(pool);
+}
+
+// Helps out with the work until the whole pool is drained, then sleeps on the workers going idle
+void tpool_wait(TPool *pool) {
+	if (pool->schedule) {
+		tsched_wait(pool, &pool->worker_idle, tpool_ready_quiescent, NULL);
+		return;
+	}
+	for (;;) {
+		if (tpool_run_one(pool)) {
+			continue;
+		}
+
+		if (tpool_quiescent(pool)) {
+			break;
+		}
+
+		tpool_park(pool, &pool->worker_idle, tpool_ready_quiescent, NULL);
+	}
+}
+
+void tpool_group_init(TPoolGroup *group) {
+	atomic_store_explicit(&group->pending, 0, memory_order_relaxed);
+	memset(&group->then, 0, sizeof(group->then));
+}
+
+void tpool_group_push(TPool *pool, TPoolGroup *group, TPoolTask task) {
+	atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+	ttask_report_to(&task, group, 0);
+	tpool__push(pool, task, TPOOL_PRIORITY_NORMAL);
+}
+
+void tpool_group_push_batch(TPool *pool, TPoolGroup *group, const TPoolTask *tasks, size_t count) {
+	tpool__push_batch(pool, group, tasks, count);
+}
+
+// Call from inside a task, on a fresh group, before pushing anything into it. Sets task to be pushed once the
+// group drains, and holds the group open until tpool_group_seal so it can't drain while children are still going in.
+// Whatever group or future the running task reports to is moved onto task, so it finishes when task does, with
+// task's return value.
+void tpool_group_then(TPoolGroup *group, TPoolTask task) {
+	Thread *self = current_thread;
+	ttask_report_to(&task, NULL, 0);
+	if (self && self->running) {
+		task.completion = self->running->completion;
+		ttask_report_to(self->running, NULL, 0);
+	}
+
+	// counted as pushed now, while the running task is still in flight, so the pool can't look quiescent between
+	// the last child finishing and the continuation going in. Off the pool we don't know which pool yet, so
+	// tpool_group_seal counts it, which is still before the group can drain.
+	if (self) {
+		tpool__count(&self->counters.tasks_pushed);
+	} else {
+		task.completion |= TPOOL_TASK_UNCOUNTED;
+	}
+
+	group->then = task;
+	atomic_store_explicit(&group->pending, 1, memory_order_relaxed);
+}
+
+// Lets go of the hold from tpool_group_then. Don't touch the group after this, its continuation owns it.
+void tpool_group_seal(TPool *pool, TPoolGroup *group) {
+	if (group->then.completion & TPOOL_TASK_UNCOUNTED) {
+		group->then.completion &= ~(uintptr_t)TPOOL_TASK_UNCOUNTED;
+		atomic_fetch_add_explicit(&pool->inject.tasks_pushed, 1, memory_order_seq_cst);
+	}
+	tpool_group_finish(pool, group);
+}
+
+// Something that isn't a pool task, like I/O, that the group should also wait for. Pair each with a
+// tpool_group_finish, which any thread can call, in or out of the pool.
+void tpool_group_add(TPoolGroup *group, int64_t count) {
+	atomic_fetch_add_explicit(&group->pending, count, memory_order_relaxed);
+}
+
+void tpool_group_finish(TPool *pool, TPoolGroup *group) {
+	if (tgroup_finish_one(pool, group)) {
+		tevent_notify_all(&pool->completion);
+	}
+}
+
+static bool tpool_group_ready(TPool *pool, void *ctx) {
+	(void)pool;
+	TPoolGroup *group = (TPoolGroup *)ctx;
+	return (atomic_load_explicit(&group->pending, memory_order_acquire) & ~TPOOL_GROUP_WAITING) == 0;
+}
+
+// Waits for every task pushed into the group, including ones pushed by the group's own tasks.
+// Runs whatever it can find in the meantime, our own queue first, so it's safe to call from inside a task.
+void tpool_group_wait(TPool *pool, TPoolGroup *group) {
+	if (pool->schedule) {
+		tpool__set_flag(&group->pending, TPOOL_GROUP_WAITING);
+		tsched_wait(pool, &pool->completion, tpool_group_ready, group);
+		return;
+	}
+	while (!tpool_group_ready(pool, group)) {
+		if (tpool_run_one(pool)) {
+			continue;
+		}
+
+		// tpool_park checks again after it's registered, so a finish that missed the flag can't be missed here
+		tpool__set_flag(&group->pending, TPOOL_GROUP_WAITING);
+		tpool_park(pool, &pool->completion, tpool_group_ready, group);
+	}
+}
+
+static TPoolFuture *tfuture_alloc(Thread *thread) {
+	if (!thread->free_futures) {
+		TPoolFutureBlock *block = malloc(sizeof(TPoolFutureBlock));
+		if (!block) {
+			return NULL;
+		}
+		block->next = thread->future_blocks;
+		thread->future_blocks = block;
+
+		for (int i = 0; i < TPOOL_FUTURE_BLOCK_SIZE; i++) {
+			block->futures[i].next_free = thread->free_futures;
+			thread->free_futures = &block->futures[i];
+		}
+	}
+
+	TPoolFuture *future = thread->free_futures;
+	thread->free_futures = future->next_free;
+	return future;
+}
+
+static void tfuture_release(Thread *thread, TPoolFuture *future) {
+	future->next_free = thread->free_futures;
+	thread->free_futures = future;
+}
+
+static void tfuture_free_blocks(Thread *thread) {
+	while (thread->future_blocks) {
+		TPoolFutureBlock *next = thread->future_blocks->next;
+		free(thread->future_blocks);
+		thread->future_blocks = next;
+	}
+	thread->free_futures = NULL;
+}
+
+// Pushes a task and hands back a future for its return value, NULL if we couldn't get one.
+// Every future has to be collected with tpool_future_wait exactly once, from a thread in the pool.
+TPoolFuture *tpool_spawn(TPool *pool, tpool_task_proc *do_work, void *args) {
+	TPoolFuture *future = tfuture_alloc(current_thread);
+	if (!future) {
+		return NULL;
+	}
+	atomic_store_explicit(&future->done, 0, memory_order_relaxed);
+	future->result = 0;
+
+	TPoolTask task = { .do_work = do_work, .args = args };
+	ttask_report_to(&task, future, TPOOL_TASK_FUTURE);
+	tpool__push(pool, task, TPOOL_PRIORITY_NORMAL);
+	return future;
+}
+
+bool tpool_future_done(TPoolFuture *future) {
+	return (atomic_load_explicit(&future->done, memory_order_acquire) & TPOOL_FUTURE_DONE) != 0;
+}
+
+static bool tpool_future_ready(TPool *pool, void *ctx) {
+	(void)pool;
+	return tpool_future_done((TPoolFuture *)ctx);
+}
+
+// Returns whatever the task returned (negative values are errors, by the usual ssize_t convention) and gives the
+// future back to the free list. Runs other tasks while it waits, same as tpool_group_wait.
+ssize_t tpool_future_wait(TPool *pool, TPoolFuture *future) {
+	if (pool->schedule) {
+		// same as tpool_group_wait, but there's still the result to take once it's done
+		tpool__set_flag(&future->done, TPOOL_FUTURE_WAITING);
+		tsched_wait(pool, &pool->completion, tpool_future_ready, future);
+	} else {
+		while (!tpool_future_done(future)) {
+			if (tpool_run_one(pool)) {
+				continue;
+			}
+
+			tpool__set_flag(&future->done, TPOOL_FUTURE_WAITING);
+			tpool_park(pool, &pool->completion, tpool_future_ready, future);
+		}
+	}
+
+	ssize_t result = future->result;
+	tfuture_release(current_thread, future);
+	return result;
+}
+
+// Any time, from any thread. Each counter is read on its own, so they can be a little out of step with each other.
+void tpool_thread_stats(TPool *pool, int idx, TPoolStats *stats) {
+	Thread *thread = &pool->threads[idx];
+	TPoolThreadStats *live = &thread->stats;
+	memset(stats, 0, sizeof(*stats));
+
+	stats->tasks_executed = atomic_load_explicit(&thread->counters.tasks_done, memory_order_relaxed);
+	stats->tasks_pushed   = atomic_load_explicit(&thread->counters.tasks_pushed, memory_order_relaxed);
+	stats->peak_queue_depth = atomic_load_explicit(&live->peak_queue_depth, memory_order_relaxed);
+
+	stats->steal_attempts = atomic_load_explicit(&live->steal_attempts, memory_order_relaxed);
+	for (int level = 0; level < TPOOL_STEAL_LEVELS; level++) {
+		stats->steals[level] = atomic_load_explicit(&live->steals[level], memory_order_relaxed);
+	}
+	stats->tasks_stolen = atomic_load_explicit(&live->tasks_stolen, memory_order_relaxed);
+	stats->steals_lost  = atomic_load_explicit(&live->steals_lost, memory_order_relaxed);
+
+	stats->spin_ns = atomic_load_explicit(&live->spin_ns, memory_order_relaxed);
+	stats->park_ns = atomic_load_explicit(&live->park_ns, memory_order_relaxed);
+	stats->parks   = atomic_load_explicit(&live->parks, memory_order_relaxed);
+	stats->unparks = atomic_load_explicit(&live->unparks, memory_order_relaxed);
+	stats->wakes   = atomic_load_explicit(&live->wakes, memory_order_relaxed);
+	stats->wake_latency_ns     = atomic_load_explicit(&live->wake_latency_ns, memory_order_relaxed);
+	stats->wake_latency_max_ns = atomic_load_explicit(&live->wake_latency_max_ns, memory_order_relaxed);
+}
+
+// Sums every thread's stats, the peaks are the max. Tasks pushed from outside the pool are in tasks_pushed too.
+void tpool_stats(TPool *pool, TPoolStats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	stats->tasks_pushed = atomic_load_explicit(&pool->inject.tasks_pushed, memory_order_relaxed);
+
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		TPoolStats thread;
+		tpool_thread_stats(pool, i, &thread);
+
+		stats->tasks_executed += thread.tasks_executed;
+		stats->tasks_pushed   += thread.tasks_pushed;
+		if (thread.peak_queue_depth > stats->peak_queue_depth) {
+			stats->peak_queue_depth = thread.peak_queue_depth;
+		}
+
+		stats->steal_attempts += thread.steal_attempts;
+		for (int level = 0; level < TPOOL_STEAL_LEVELS; level++) {
+			stats->steals[level] += thread.steals[level];
+		}
+		stats->tasks_stolen += thread.tasks_stolen;
+		stats->steals_lost  += thread.steals_lost;
+
+		stats->spin_ns += thread.spin_ns;
+		stats->park_ns += thread.park_ns;
+		stats->parks   += thread.parks;
+		stats->unparks += thread.unparks;
+		stats->wakes   += thread.wakes;
+		stats->wake_latency_ns += thread.wake_latency_ns;
+		if (thread.wake_latency_max_ns > stats->wake_latency_max_ns) {
+			stats->wake_latency_max_ns = thread.wake_latency_max_ns;
+		}
+	}
+}
+
+/*
+	Task graphs
+
+	Every node counts down its predecessors, and whoever finishes the last one pushes the node onto its own queue,
+	right where the data it just produced is still warm. Nodes go into the graph's group when they're pushed, and
+	a node pushes its successors before it counts as done, so the group only drains once the whole graph has run.
+*/
+
+TPoolGraph *tpool_graph_create(void) {
+	TPoolGraph *graph = calloc(sizeof(TPoolGraph), 1);
+	if (graph) {
+		graph->dirty = true;
+	}
+	return graph;
+}
+
+// Not while it's running. Doesn't touch the pool, so it's fine after tpool_destroy.
+void tpool_graph_destroy(TPoolGraph *graph) {
+	for (int i = 0; i < graph->node_count; i++) {
+		TPoolGraphNode *node = &graph->nodes[i];
+		void *spilled = ttask_spilled(&node->task);
+		if (spilled) {
+			// always the graph's own malloc'd copy, see tpool_graph_add
+			free((TPoolSpill *)spilled - 1);
+		}
+		free(node->successors);
+	}
+	free(graph->nodes);
+	free(graph->roots);
+	free(graph);
+}
+
+// Returns the new node's id, -1 if we're out of memory. The task's group or future, if any, is ignored.
+int tpool_graph_add(TPoolGraph *graph, TPoolTask task) {
+	if (graph->node_count == graph->node_capacity) {
+		int capacity = graph->node_capacity ? graph->node_capacity * 2 : 16;
+		TPoolGraphNode *nodes = realloc(graph->nodes, sizeof(TPoolGraphNode) * capacity);
+		if (!nodes) {
+			return -1;
+		}
+		graph->nodes = nodes;
+		graph->node_capacity = capacity;
+	}
+
+	// A slab block would have to go back to its pool's thread when the graph goes, and the graph can outlive the
+	// pool, so the graph keeps the closure in a malloc'd block of its own. We don't know how much of the slab block
+	// is closure, so the whole thing comes along.
+	void *spilled = ttask_spilled(&task);
+	TPoolSpill *spill = spilled ? (TPoolSpill *)spilled - 1 : NULL;
+	if (spill && spill->size_class != TPOOL_SPILL_CLASSES) {
+		size_t size = ((size_t)128 << spill->size_class) - sizeof(TPoolSpill);
+		TPoolSpill *copy = malloc(sizeof(TPoolSpill) + size);
+		if (!copy) {
+			return -1;
+		}
+		copy->size_class = TPOOL_SPILL_CLASSES;
+		memcpy(copy + 1, spilled, size);
+		tspill_release(current_thread, spilled);
+		void *data = copy + 1;
+		memcpy(task.payload + sizeof(void *), &data, sizeof(data));
+	}
+
+	TPoolGraphNode *node = &graph->nodes[graph->node_count];
+	memset(node, 0, sizeof(*node));
+	ttask_report_to(&task, NULL, 0);
+	node->task = task;
+	graph->dirty = true;
+	return graph->node_count++;
+}
+
+// after won't start until before has finished. False if either isn't a node, or we're out of memory.
+bool tpool_graph_edge(TPoolGraph *graph, int before, int after) {
+	if (before < 0 || before >= graph->node_count || after < 0 || after >= graph->node_count) {
+		return false;
+	}
+
+	TPoolGraphNode *node = &graph->nodes[before];
+	if (node->successor_count == node->successor_capacity) {
+		int capacity = node->successor_capacity ? node->successor_capacity * 2 : 4;
+		int *successors = realloc(node->successors, sizeof(int) * capacity);
+		if (!successors) {
+			return false;
+		}
+		node->successors = successors;
+		node->successor_capacity = capacity;
+	}
+
+	node->successors[node->successor_count++] = after;
+	graph->nodes[after].predecessor_count++;
+	graph->dirty = true;
+	return true;
+}
+
+// Finds the roots, and checks there's no cycle while we're at it (Kahn's algorithm)
+static bool tgraph_prepare(TPoolGraph *graph) {
+	free(graph->roots);
+	graph->roots = malloc(sizeof(int) * (graph->node_count ? graph->node_count : 1));
+	int *order = malloc(sizeof(int) * (graph->node_count ? graph->node_count : 1));
+	if (!graph->roots || !order) {
+		free(order);
+		return false;
+	}
+
+	graph->root_count = 0;
+	int order_count = 0;
+	for (int i = 0; i < graph->node_count; i++) {
+		graph->nodes[i].graph = graph;
+		atomic_store_explicit(&graph->nodes[i].pending, graph->nodes[i].predecessor_count, memory_order_relaxed);
+		if (graph->nodes[i].predecessor_count == 0) {
+			graph->roots[graph->root_count++] = i;
+			order[order_count++] = i;
+		}
+	}
+	for (int i = 0; i < order_count; i++) {
+		TPoolGraphNode *node = &graph->nodes[order[i]];
+		for (int j = 0; j < node->successor_count; j++) {
+			TPoolGraphNode *next = &graph->nodes[node->successors[j]];
+			int64_t pending = atomic_load_explicit(&next->pending, memory_order_relaxed) - 1;
+			atomic_store_explicit(&next->pending, pending, memory_order_relaxed);
+			if (pending == 0) {
+				order[order_count++] = node->successors[j];
+			}
+		}
+	}
+	free(order);
+
+	graph->acyclic = order_count == graph->node_count;
+	graph->dirty = false;
+	return true;
+}
+
+static ssize_t tgraph_node_task(void *args) {
+	TPoolGraphNode *node = args;
+	TPoolGraph *graph = node->graph;
+	TPool *pool = current_thread->pool;
+
+	TPoolTask *task = &node->task;
+	TPOOL_TRACE_TASK_BEGIN((void *)task->do_work);
+	// the node keeps its closure for the next run, so a spilled block stays where it is
+	void *spilled = NULL;
+	node->result = ttask_call(task, &spilled);
+	TPOOL_TRACE_TASK_END();
+
+	for (int i = 0; i < node->successor_count; i++) {
+		TPoolGraphNode *next = &graph->nodes[node->successors[i]];
+		if (atomic_fetch_add_explicit(&next->pending, -1, memory_order_acq_rel) == 1) {
+			TPoolTask next_task = { .do_work = tgraph_node_task, .args = next };
+			tpool_group_push(pool, &graph->group, next_task);
+		}
+	}
+	return 0;
+}
+
+// Pushes every node without predecessors and returns, call tpool_graph_wait for the rest. From a pool thread.
+// Returns false, without running anything, if the graph has a cycle or we ran out of memory.
+// A graph can't be run again, or changed, until the last run has been waited on.
+bool tpool_graph_run(TPool *pool, TPoolGraph *graph) {
+	if (graph->dirty && !tgraph_prepare(graph)) {
+		return false;
+	}
+	if (!graph->acyclic) {
+		return false;
+	}
+
+	for (int i = 0; i < graph->node_count; i++) {
+		atomic_store_explicit(&graph->nodes[i].pending, graph->nodes[i].predecessor_count, memory_order_relaxed);
+	}
+	tpool_group_init(&graph->group);
+	for (int i = 0; i < graph->root_count; i++) {
+		TPoolTask task = { .do_work = tgraph_node_task, .args = &graph->nodes[graph->roots[i]] };
+		tpool_group_push(pool, &graph->group, task);
+	}
+	return true;
+}
+
+// Helps out until every node in the current run has finished
+void tpool_graph_wait(TPool *pool, TPoolGraph *graph) {
+	tpool_group_wait(pool, &graph->group);
+}
+
+// What the node's task returned on the last run
+ssize_t tpool_graph_result(TPoolGraph *graph, int node) {
+	return graph->nodes[node].result;
+}
+
+/*
+	Parallel for / reduce
+
+	Lazy binary splitting: whoever is running a range works through it grain iterations at a time, and only splits
+	off the top half for someone else when its own queue is empty, meaning whatever it put there last has been
+	stolen. Nobody stealing means no splits, so one thread runs the whole loop with a queue check per grain.
+
+	For reduce, every piece that gets split off accumulates into its own copy of acc, and the pieces are joined back
+	together in range order at the end, so join only has to be associative.
+*/
+
+typedef struct TPoolForNode {
+	struct TPoolForLoop *loop;
+	int64_t begin;
+	int64_t end;
+	struct TPoolForNode *next;
+} TPoolForNode;
+
+#define TPOOL_FOR_NODE_SIZE ((sizeof(TPoolForNode) + 15) & ~(size_t)15)
+#define TPOOL_FOR_ACC(node) ((void *)((char *)(node) + TPOOL_FOR_NODE_SIZE))
+
+typedef struct TPoolForLoop {
+	TPool *pool;
+	TPoolGroup group;
+	int64_t grain;
+
+	tpool_for_proc *fn;
+	tpool_reduce_proc *reduce;
+	void *ctx;
+
+	// acc_size bytes, copied into every node
+	const void *identity;
+	size_t acc_size;
+
+	TPoolForNode *_Atomic nodes;
+} TPoolForLoop;
+
+static TPoolForNode *tpool_for_node(TPoolForLoop *loop, int64_t begin, int64_t end) {
+	TPoolForNode *node = malloc(TPOOL_FOR_NODE_SIZE + loop->acc_size);
+	if (!node) {
+		return NULL;
+	}
+	node->loop = loop;
+	node->begin = begin;
+	node->end = end;
+	memcpy(TPOOL_FOR_ACC(node), loop->identity, loop->acc_size);
+
+	TPoolForNode *next = atomic_load_explicit(&loop->nodes, memory_order_relaxed);
+	do {
+		node->next = next;
+	} while (!atomic_compare_exchange_strong_explicit(&loop->nodes, &next, node, memory_order_release, memory_order_relaxed));
+	return node;
+}
+
+static ssize_t tpool_for_task(void *args);
+
+static void tpool_for_run(TPoolForNode *node) {
+	TPoolForLoop *loop = node->loop;
+	int64_t begin = node->begin;
+	int64_t end = node->end;
+
+	while (begin < end) {
+		if (end - begin > loop->grain && atomic_load_explicit(&loop->pool->thread_count, memory_order_relaxed) > 1 && tqueue_size(&current_thread->queues[TPOOL_PRIORITY_NORMAL]) == 0) {
+			int64_t mid = begin + (end - begin) / 2;
+			TPoolForNode *split = tpool_for_node(loop, mid, end);
+			if (split) {
+				TPoolTask task = { .do_work = tpool_for_task, .args = split };
+				tpool_group_push(loop->pool, &loop->group, task);
+				end = mid;
+				continue;
+			}
+		}
+
+		int64_t chunk_end = (end - begin > loop->grain) ? begin + loop->grain : end;
+		if (loop->fn) {
+			loop->fn(loop->ctx, begin, chunk_end);
+		} else {
+			loop->reduce(loop->ctx, begin, chunk_end, TPOOL_FOR_ACC(node));
+		}
+		begin = chunk_end;
+	}
+
+	// whatever we split off is someone else's now
+	node->end = end;
+}
+
+static ssize_t tpool_for_task(void *args) {
+	tpool_for_run((TPoolForNode *)args);
+	return 0;
+}
+
+static int tpool_for_node_cmp(const void *a, const void *b) {
+	int64_t a_begin = (*(TPoolForNode **)a)->begin;
+	int64_t b_begin = (*(TPoolForNode **)b)->begin;
+	return (a_begin > b_begin) - (a_begin < b_begin);
+}
+
+static void tpool_for_loop(TPoolForLoop *loop, int64_t begin, int64_t end, tpool_join_proc *join, void *acc) {
+	if (begin >= end) {
+		return;
+	}
+	if (loop->grain < 1) {
+		loop->grain = 1;
+	}
+	tpool_group_init(&loop->group);
+	atomic_store_explicit(&loop->nodes, NULL, memory_order_relaxed);
+
+	TPoolForNode *root = tpool_for_node(loop, begin, end);
+	if (!root) {
+		// no memory for bookkeeping, just do it ourselves
+		if (loop->fn) {
+			loop->fn(loop->ctx, begin, end);
+		} else {
+			loop->reduce(loop->ctx, begin, end, acc);
+		}
+		return;
+	}
+
+	// our share of the loop runs outside any task, so it takes a turn like a push would
+	bool entered = tsched_enter(loop->pool);
+	tpool_for_run(root);
+	tpool_group_wait(loop->pool, &loop->group);
+	tsched_leave(loop->pool, entered);
+
+	TPoolForNode *nodes = atomic_load_explicit(&loop->nodes, memory_order_acquire);
+	if (join) {
+		size_t node_count = 0;
+		for (TPoolForNode *node = nodes; node; node = node->next) {
+			node_count++;
+		}
+
+		TPoolForNode *sorted_stack[64];
+		TPoolForNode **sorted = node_count <= 64 ? sorted_stack : malloc(sizeof(TPoolForNode *) * node_count);
+		if (sorted) {
+			size_t i = 0;
+			for (TPoolForNode *node = nodes; node; node = node->next) {
+				sorted[i++] = node;
+			}
+			qsort(sorted, node_count, sizeof(TPoolForNode *), tpool_for_node_cmp);
+
+			memcpy(acc, TPOOL_FOR_ACC(sorted[0]), loop->acc_size);
+			for (i = 1; i < node_count; i++) {
+				join(loop->ctx, acc, TPOOL_FOR_ACC(sorted[i]));
+			}
+
+			if (sorted != sorted_stack) {
+				free(sorted);
+			}
+		} else {
+			// No memory to sort with, so pick the nodes out in order instead. Quadratic, but the joins still go left
+			// to right.
+			TPoolForNode *prev = NULL;
+			for (size_t i = 0; i < node_count; i++) {
+				TPoolForNode *next = NULL;
+				for (TPoolForNode *node = nodes; node; node = node->next) {
+					if ((!prev || node->begin > prev->begin) && (!next || node->begin < next->begin)) {
+						next = node;
+					}
+				}
+				if (prev) {
+					join(loop->ctx, acc, TPOOL_FOR_ACC(next));
+				} else {
+					memcpy(acc, TPOOL_FOR_ACC(next), loop->acc_size);
+				}
+				prev = next;
+			}
+		}
+	}
+
+	while (nodes) {
+		TPoolForNode *next = nodes->next;
+		free(nodes);
+		nodes = next;
+	}
+}
+
+// Calls fn over [begin, end) in subranges of at most grain iterations, spread over the pool as thieves show up.
+// Returns once the whole range is done, helping out with other work in the meantime.
+void tpool_parallel_for(TPool *pool, int64_t begin, int64_t end, int64_t grain, tpool_for_proc *fn, void *ctx) {
+	TPoolForLoop loop = {0};
+	loop.pool = pool;
+	loop.grain = grain;
+	loop.fn = fn;
+	loop.ctx = ctx;
+	tpool_for_loop(&loop, begin, end, NULL, NULL);
+}
+
+// acc holds acc_size bytes of the identity on the way in, and the result on the way out.
+// fn folds a subrange into an accumulator, join folds the right-hand accumulator into the left.
+void tpool_parallel_reduce(TPool *pool, int64_t begin, int64_t end, int64_t grain, tpool_reduce_proc *fn, tpool_join_proc *join, void *ctx, void *acc, size_t acc_size) {
+	void *identity = malloc(acc_size ? acc_size : 1);
+	if (!identity) {
+		fn(ctx, begin, end, acc);
+		return;
+	}
+	memcpy(identity, acc, acc_size);
+
+	TPoolForLoop loop = {0};
+	loop.pool = pool;
+	loop.grain = grain;
+	loop.reduce = fn;
+	loop.ctx = ctx;
+	loop.identity = identity;
+	loop.acc_size = acc_size;
+	tpool_for_loop(&loop, begin, end, join, acc);
+
+	free(identity);
+}
+
+void thread_start(Thread *thread) {
+	atomic_store_explicit(&thread->active, true, memory_order_relaxed);
+	pthread_create(&thread->thread, NULL, tpool_worker, (void *)thread);
+}
+// The queues stay, see thread_init_queues
+void thread_end(Thread *thread) {
+	pthread_join(thread->thread, NULL);
+}
+
+// Workers set up their own queue once they're running, see tpool_worker
+void thread_init(TPool *pool, Thread *thread, int idx) {
+	thread->pool = pool;
+	thread->idx = idx;
+	thread->place = (TPoolPlace){ -1, -1, -1, -1 };
+	thread->rng = 0x9E3779B97F4A7C15ull * (uint64_t)(idx + 1);
+	if (pool->schedule && pool->schedule->seed) {
+		thread->rng = tsched__mix(pool->schedule->seed + (uint64_t)idx) | 1;
+	}
+	thread->victims = malloc(sizeof(int) * (pool->max_thread_count > 1 ? pool->max_thread_count - 1 : 1));
+}
+
+TPool *tpool_init_opts(const TPoolOptions *opts) {
+	TPool *pool = calloc(sizeof(TPool), 1);
+
+	int thread_count = opts->child_thread_count + 1;
+
+	atomic_store_explicit(&pool->thread_count, thread_count, memory_order_relaxed);
+	pool->max_thread_count = opts->max_thread_count > thread_count ? opts->max_thread_count : thread_count;
+	pool->threads = tpool__alloc_aligned(sizeof(Thread) * pool->max_thread_count);
+	tevent_init(&pool->work_available);
+	tevent_init(&pool->worker_idle);
+	tevent_init(&pool->completion);
+	atomic_store_explicit(&pool->spin_count, TPOOL_SPIN_COUNT, memory_order_relaxed);
+	atomic_store_explicit(&pool->running, true, memory_order_relaxed);
+	pool->steal_half = opts->steal_half;
+	tinject_init(&pool->inject);
+
+	pool->schedule = opts->schedule;
+	if (pool->schedule) {
+		TPoolSchedule *sched = pool->schedule;
+		if (tsched_replaying(sched) && sched->thread_count != thread_count) {
+			sched->diverged = true;
+			atomic_store_explicit(&sched->replay_end, 0, memory_order_relaxed);
+		}
+		sched->thread_count = thread_count;
+		sched->rng = tsched__mix(sched->seed) | 1;
+		atomic_store_explicit(&sched->holder, -1, memory_order_relaxed);
+		atomic_store_explicit(&sched->next, -1, memory_order_relaxed);
+	}
+
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		thread_init(pool, &pool->threads[i], i);
+	}
+
+	if (opts->pin_threads) {
+		TPoolPlace *places = malloc(sizeof(TPoolPlace) * TPOOL_MAX_CPUS);
+		int cpu_count = places ? tpool__topology(places) : 0;
+#ifdef __linux__
+		pool->pinned = cpu_count > 0 && tpool__get_affinity(pool->saved_affinity);
+#endif
+		if (pool->pinned) {
+			// more threads than cpus just wraps around and doubles up
+			for (int i = 0; i < pool->max_thread_count; i++) {
+				pool->threads[i].place = places[i % cpu_count];
+			}
+		}
+		free(places);
+	}
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		tpool__sort_victims(pool, &pool->threads[i]);
+	}
+
+	// setup the main thread
+	tplace_pin(&pool->threads[0].place);
+	thread_init_queues(&pool->threads[0]);
+	atomic_store_explicit(&pool->threads[0].active, true, memory_order_relaxed);
+	current_thread = &pool->threads[0];
+
+	for (int i = 1; i < thread_count; i++) {
+		thread_start(&pool->threads[i]);
+	}
+
+	return pool;
+}
+
+TPool *tpool_init(int child_thread_count) {
+	TPoolOptions opts = {0};
+	opts.child_thread_count = child_thread_count;
+	return tpool_init_opts(&opts);
+}
+
+// Grows or shrinks the pool to thread_count threads, the calling one included, up to the max_thread_count it was
+// made with. New workers start on the lowest free slots and the highest go first, so thread_count stays a prefix.
+// A retired worker finishes the task it's on and whatever's left on its own queues, and this waits for it to.
+// From the thread that made the pool, outside of any task. Returns false if thread_count is out of range, or if
+// the pool's on a deterministic schedule, where the threads are part of what gets recorded.
+bool tpool_set_thread_count(TPool *pool, int thread_count) {
+	if (thread_count < 1 || thread_count > pool->max_thread_count || pool->schedule) {
+		return false;
+	}
+
+	int old_count = atomic_load_explicit(&pool->thread_count, memory_order_relaxed);
+	for (int i = old_count; i < thread_count; i++) {
+		thread_start(&pool->threads[i]);
+	}
+	atomic_store_explicit(&pool->thread_count, thread_count, memory_order_relaxed);
+
+	if (thread_count < old_count) {
+		for (int i = thread_count; i < old_count; i++) {
+			atomic_store_explicit(&pool->threads[i].active, false, memory_order_release);
+		}
+		tevent_notify_all(&pool->work_available);
+		for (int i = thread_count; i < old_count; i++) {
+			thread_end(&pool->threads[i]);
+		}
+	}
+	return true;
+}
+
+int tpool_thread_count(TPool *pool) {
+	return atomic_load_explicit(&pool->thread_count, memory_order_relaxed);
+}
+
+// Outside of any task, and nothing can be pushing. Anything still queued is dropped.
+void tpool_destroy(TPool *pool) {
+	int thread_count = atomic_load_explicit(&pool->thread_count, memory_order_relaxed);
+	atomic_store_explicit(&pool->running, false, memory_order_release);
+	tevent_notify_all(&pool->work_available);
+	for (int i = 1; i < thread_count; i++) {
+		thread_end(&pool->threads[i]);
+	}
+
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		for (int lane = 0; lane < TPOOL_PRIORITIES; lane++) {
+			tqueue_free(&pool->threads[i].queues[lane]);
+		}
+		tfuture_free_blocks(&pool->threads[i]);
+		tspill_free_chunks(&pool->threads[i]);
+		free(pool->threads[i].victims);
+	}
+#ifdef __linux__
+	if (pool->pinned) {
+		tpool__set_affinity(pool->saved_affinity);
+	}
+#endif
+	tpool__free_aligned(pool->inject.cells);
+	tpool__free_aligned(pool->threads);
+	free(pool);
+}
+
+#endif // TPOOL_IMPLEMENTED
+#endif // TPOOL_IMPLEMENTATION
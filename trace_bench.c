@@ -0,0 +1,377 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "spall_auto.h"
+#include "spall.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if _WIN32
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#define TPOOL_IMPLEMENTATION
+#include "tpool.h"
+
+#if _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi")
+#endif
+
+static double bench_rss_mb(void) {
+#ifdef __linux__
+	long size = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (!f) return 0;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2) resident = 0;
+	fclose(f);
+	return (double)resident * sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+#elif _WIN32
+	PROCESS_MEMORY_COUNTERS counters = { sizeof(counters) };
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return (double)counters.WorkingSetSize / (1024.0 * 1024.0);
+#else
+	return 0; // no cheap current-RSS query here, the column reads 0
+#endif
+}
+
+// Everyone checks in, then waits for the main thread to let them through
+static _Atomic int bench_arrived;
+static _Atomic int bench_phase;
+static void bench_arrive_and_wait(int phase) {
+	atomic_fetch_add(&bench_arrived, 1);
+	while (atomic_load(&bench_phase) < phase) {
+		sched_yield();
+	}
+}
+static void bench_wait_for(int thread_count) {
+	while (atomic_load(&bench_arrived) < thread_count) {
+		sched_yield();
+	}
+	atomic_store(&bench_arrived, 0);
+}
+
+/*
+	Thread init benchmark
+
+	What tracing costs a thread before it has traced anything: how long spall_auto_thread_init takes with the default
+	buffer size, and how much resident memory that adds, for a few thread counts. Then every thread writes the same
+	number of events, so the cost of committing the buffer on the way shows up in ns_per_event and rss_used_mb.
+
+	Build with -DSPALL_AUTO_POPULATE=1 to compare against faulting each whole buffer in at init.
+*/
+
+typedef struct InitBenchThread {
+	int idx;
+	int events;
+	uint64_t init_ns;
+	uint64_t event_ns;
+} InitBenchThread;
+
+static void *init_bench_worker(void *ptr) {
+	InitBenchThread *t = (InitBenchThread *)ptr;
+
+	uint64_t begin = tpool_now_ns();
+	spall_auto_thread_init(t->idx + 1, SPALL_DEFAULT_BUFFER_SIZE, SPALL_DEFAULT_SYMBOL_CACHE_SIZE);
+	t->init_ns = tpool_now_ns() - begin;
+	bench_arrive_and_wait(1);
+
+	begin = tpool_now_ns();
+	for (int i = 0; i < t->events; i++) {
+		spall_auto_begin("event", sizeof("event") - 1, "", 0);
+		spall_auto_end();
+	}
+	t->event_ns = tpool_now_ns() - begin;
+	bench_arrive_and_wait(2);
+
+	spall_auto_thread_quit();
+	return NULL;
+}
+
+static void init_bench(int thread_count, int events) {
+	InitBenchThread *threads = calloc(sizeof(InitBenchThread), thread_count);
+	pthread_t *handles = calloc(sizeof(pthread_t), thread_count);
+	atomic_store(&bench_arrived, 0);
+	atomic_store(&bench_phase, 0);
+
+	double rss_base = bench_rss_mb();
+	for (int i = 0; i < thread_count; i++) {
+		threads[i].idx = i;
+		threads[i].events = events;
+		pthread_create(&handles[i], NULL, init_bench_worker, &threads[i]);
+	}
+
+	bench_wait_for(thread_count);
+	double rss_init = bench_rss_mb();
+	atomic_store(&bench_phase, 1);
+
+	bench_wait_for(thread_count);
+	double rss_used = bench_rss_mb();
+	atomic_store(&bench_phase, 2);
+
+	for (int i = 0; i < thread_count; i++) {
+		pthread_join(handles[i], NULL);
+	}
+
+	uint64_t init_sum = 0, init_max = 0, event_sum = 0;
+	for (int i = 0; i < thread_count; i++) {
+		init_sum += threads[i].init_ns;
+		if (threads[i].init_ns > init_max) init_max = threads[i].init_ns;
+		event_sum += threads[i].event_ns;
+	}
+
+	printf("%-8d %14.1f %14.1f %14.1f %14.1f %14.1f\n",
+	       thread_count,
+	       (double)init_sum / thread_count / 1000.0,
+	       (double)init_max / 1000.0,
+	       rss_init - rss_base,
+	       (double)event_sum / ((double)thread_count * events * 2),
+	       rss_used - rss_base);
+
+	free(handles);
+	free(threads);
+}
+
+static void init_bench_main(int argc, char **argv) {
+	int max_threads = 8;
+	int events = 1 << 18;
+	if (argc > 0) max_threads = atoi(argv[0]);
+	if (argc > 1) events = atoi(argv[1]);
+
+	printf("init: %d MB buffers, %d begin/end pairs per thread, SPALL_AUTO_POPULATE=%d\n",
+	       SPALL_DEFAULT_BUFFER_SIZE / (1024 * 1024), events, SPALL_AUTO_POPULATE);
+	printf("%-8s %14s %14s %14s %14s %14s\n",
+	       "threads", "init_mean_us", "init_max_us", "rss_init_mb", "ns_per_event", "rss_used_mb");
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		init_bench(threads, events);
+		fflush(stdout);
+	}
+}
+
+/*
+	Write benchmark
+
+	Several threads flushing full buffers into one profile at once, the way the writer and anything else with a
+	buffer of its own do: spall_init_file, where every write goes through the one FILE and its lock, against
+	spall_init_mmap, where a write is an atomic add and a memcpy into the mapping. Not available on Windows.
+*/
+
+#if !_WIN32
+typedef struct WriteBenchThread {
+	SpallProfile *ctx;
+	size_t buffer_size;
+	int flushes;
+} WriteBenchThread;
+
+static void *write_bench_worker(void *ptr) {
+	WriteBenchThread *t = (WriteBenchThread *)ptr;
+	uint8_t *buffer = malloc(t->buffer_size);
+	memset(buffer, 1, t->buffer_size);
+	bench_arrive_and_wait(1);
+	for (int i = 0; i < t->flushes; i++) {
+		t->ctx->write(t->ctx, buffer, t->buffer_size);
+	}
+	free(buffer);
+	return NULL;
+}
+
+static void write_bench(bool use_mmap, int thread_count, size_t buffer_size, int flushes) {
+	SpallProfile ctx = use_mmap ? spall_init_mmap("trace_bench_write.spall", 1) : spall_init_file("trace_bench_write.spall", 1);
+	if (!ctx.write) {
+		printf("%-8s couldn't open trace_bench_write.spall\n", use_mmap ? "mmap" : "file");
+		return;
+	}
+
+	WriteBenchThread *threads = calloc(sizeof(WriteBenchThread), thread_count);
+	pthread_t *handles = calloc(sizeof(pthread_t), thread_count);
+	atomic_store(&bench_arrived, 0);
+	atomic_store(&bench_phase, 0);
+	for (int i = 0; i < thread_count; i++) {
+		threads[i] = (WriteBenchThread){ &ctx, buffer_size, flushes };
+		pthread_create(&handles[i], NULL, write_bench_worker, &threads[i]);
+	}
+
+	bench_wait_for(thread_count);
+	uint64_t begin = tpool_now_ns();
+	atomic_store(&bench_phase, 1);
+	for (int i = 0; i < thread_count; i++) {
+		pthread_join(handles[i], NULL);
+	}
+	uint64_t write_ns = tpool_now_ns() - begin;
+
+	// closing is where the file backend's last buffer goes out and the mapping gets trimmed, so it counts
+	spall_quit(&ctx);
+	uint64_t total_ns = tpool_now_ns() - begin;
+	remove("trace_bench_write.spall");
+
+	double mb = (double)buffer_size * flushes * thread_count / (1024.0 * 1024.0);
+	printf("%-8s %8d %12.1f %12.1f %12.1f %12.1f\n",
+	       use_mmap ? "mmap" : "file", thread_count, mb,
+	       write_ns / 1000000.0, total_ns / 1000000.0, mb / (total_ns / 1000000000.0));
+
+	free(handles);
+	free(threads);
+}
+#endif
+
+static void write_bench_main(int argc, char **argv) {
+#if !_WIN32
+	int max_threads = 8;
+	int buffer_kb = 1024;
+	int total_mb = 1024;
+	if (argc > 0) max_threads = atoi(argv[0]);
+	if (argc > 1) buffer_kb = atoi(argv[1]);
+	if (argc > 2) total_mb = atoi(argv[2]);
+
+	size_t buffer_size = (size_t)buffer_kb * 1024;
+	printf("write: %d KB flushes, %d MB in total split across the threads\n", buffer_kb, total_mb);
+	printf("%-8s %8s %12s %12s %12s %12s\n", "backend", "threads", "mb", "write_ms", "total_ms", "mb_per_sec");
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		int flushes = (int)(((size_t)total_mb * 1024 * 1024) / buffer_size / threads);
+		if (flushes < 1) flushes = 1;
+		write_bench(false, threads, buffer_size, flushes);
+		write_bench(true, threads, buffer_size, flushes);
+		fflush(stdout);
+	}
+#else
+	(void)argc;
+	(void)argv;
+	printf("write: no mmap backend on Windows\n");
+#endif
+}
+
+/*
+	Size benchmark
+
+	The same function-level trace written as version 1, version 2, and version 2 with interned names (each name
+	defined once and referenced by id after, the way spall_auto does it): a random call tree over a handful of
+	symbol names, timestamped with the TSC while it's generated so the deltas are realistic. Everything goes to a
+	byte counter instead of a file, so ns_per_event is the cost of encoding alone.
+*/
+
+static const char *size_bench_names[] = {
+	"tpool_run_lane", "tqueue_pop", "tqueue_steal", "little_work", "tevent_notify", "tpool_push_batch",
+	"_ZN6engine6render12submit_drawERKNS_8DrawCallE", "_ZNSt6vectorIiSaIiEE17_M_realloc_insertIJRKiEEEvN9__gnu_cxx17__normal_iteratorIPiS1_EEDpOT_",
+};
+#define SIZE_BENCH_NAME_COUNT (sizeof(size_bench_names) / sizeof(size_bench_names[0]))
+
+static uint64_t size_bench_bytes;
+static bool size_bench_write(SpallProfile *self, const void *data, size_t length) {
+	(void)self;
+	(void)data;
+	size_bench_bytes += length;
+	return true;
+}
+
+typedef struct SizeBench {
+	SpallProfile *ctx;
+	SpallBuffer *wb;
+	int version;
+	bool intern;
+	bool defined[SIZE_BENCH_NAME_COUNT];
+	uint64_t rng;
+	uint64_t events;
+} SizeBench;
+
+static uint32_t size_bench_rand(SizeBench *bench) {
+	bench->rng ^= bench->rng << 13;
+	bench->rng ^= bench->rng >> 7;
+	bench->rng ^= bench->rng << 17;
+	return (uint32_t)bench->rng;
+}
+
+static void size_bench_call(SizeBench *bench, int depth) {
+	uint32_t id = size_bench_rand(bench) % SIZE_BENCH_NAME_COUNT;
+	const char *name = size_bench_names[id];
+	int name_len = (int)strlen(name);
+	if (bench->intern) {
+		if (!bench->defined[id]) {
+			spall_buffer_name_v2(bench->ctx, bench->wb, id, name, name_len);
+			bench->defined[id] = true;
+		}
+		spall_buffer_begin_ref_v2(bench->ctx, bench->wb, id, "", 0, __rdtsc());
+	} else if (bench->version == 2) {
+		spall_buffer_begin_v2(bench->ctx, bench->wb, name, name_len, "", 0, __rdtsc());
+	} else {
+		spall_buffer_begin_ex(bench->ctx, bench->wb, name, name_len, (double)__rdtsc(), 1, 0);
+	}
+
+	int children = depth < 6 ? size_bench_rand(bench) % 4 : 0;
+	for (int i = 0; i < children; i++) {
+		size_bench_call(bench, depth + 1);
+	}
+
+	if (bench->version == 2) {
+		spall_buffer_end_v2(bench->ctx, bench->wb, __rdtsc());
+	} else {
+		spall_buffer_end_ex(bench->ctx, bench->wb, (double)__rdtsc(), 1, 0);
+	}
+	bench->events += 2;
+}
+
+static void size_bench(const char *label, int version, bool intern, uint64_t min_events, uint64_t *v1_bytes) {
+	SpallProfile ctx = version == 2
+		? spall_init_callbacks_v2(1, size_bench_write, NULL, NULL, NULL)
+		: spall_init_callbacks(1, size_bench_write, NULL, NULL, NULL, false);
+	size_t buffer_size = 1 << 20;
+	SpallBuffer wb = { malloc(buffer_size), buffer_size };
+	if (version == 2) {
+		spall_buffer_init_v2(&ctx, &wb, 1, 0);
+	} else {
+		spall_buffer_init(&ctx, &wb);
+	}
+
+	size_bench_bytes = 0;
+	SizeBench bench = { .ctx = &ctx, .wb = &wb, .version = version, .intern = intern, .rng = 0x9E3779B97F4A7C15ull };
+	uint64_t begin = tpool_now_ns();
+	while (bench.events < min_events) {
+		size_bench_call(&bench, 0);
+	}
+	spall_buffer_quit(&ctx, &wb);
+	uint64_t ns = tpool_now_ns() - begin;
+	spall_quit(&ctx);
+	free(wb.data);
+
+	if (version == 1) *v1_bytes = size_bench_bytes;
+	printf("%-8s %12llu %14llu %16.2f %14.2f %8.2fx\n",
+	       label, (unsigned long long)bench.events, (unsigned long long)size_bench_bytes,
+	       (double)size_bench_bytes / bench.events, (double)ns / bench.events,
+	       (double)*v1_bytes / size_bench_bytes);
+}
+
+static void size_bench_main(int argc, char **argv) {
+	uint64_t events = 1 << 22;
+	if (argc > 0) events = strtoull(argv[0], NULL, 10);
+
+	printf("size: %llu events over %d names of %d to %d bytes\n", (unsigned long long)events, (int)SIZE_BENCH_NAME_COUNT,
+	       (int)strlen(size_bench_names[1]), (int)strlen(size_bench_names[SIZE_BENCH_NAME_COUNT - 1]));
+	printf("%-8s %12s %14s %16s %14s %9s\n", "version", "events", "bytes", "bytes_per_event", "ns_per_event", "vs_v1");
+	uint64_t v1_bytes = 0;
+	size_bench("1", 1, false, events, &v1_bytes);
+	size_bench("2", 2, false, events, &v1_bytes);
+	size_bench("2+ids", 2, true, events, &v1_bytes);
+}
+
+int main(int argc, char **argv) {
+	const char *mode = argc > 1 ? argv[1] : "all";
+	bool all = !strcmp(mode, "all");
+	int mode_argc = argc > 2 ? argc - 2 : 0;
+	char **mode_argv = argv + 2;
+
+	spall_auto_init("trace_bench.spall");
+
+	if (all || !strcmp(mode, "init")) init_bench_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "write")) write_bench_main(mode_argc, mode_argv);
+	if (all || !strcmp(mode, "size")) size_bench_main(mode_argc, mode_argv);
+
+	spall_auto_quit();
+	remove("trace_bench.spall");
+	return 0;
+}
+
+#define SPALL_AUTO_IMPLEMENTATION
+#include "spall_auto.h"